@@ -4,13 +4,16 @@
 #include "common.h"
 
 #include "color.h"
+#include "denoiser.h"
 #include "hittable.h"
 #include "material.h"
+#include "path_footprint.h"
+#include "path_guide.h"
+#include "primary_hit_cache.h"
+#include "sampler.h"
 #include "vec3.h"
+#include <algorithm>
 #include <cmath>
-#include <iostream>
-#include <thread>
-#include <vector>
 
 class camera {
  public:
@@ -20,6 +23,14 @@ class camera {
                                  // Результат усреднится
 
     int max_depth = 10;  // максимальное количество отскоков луча от объектов
+    int min_depth = 3;  // количество отскоков, после которых включается
+                        // русская рулетка
+    bool russian_roulette = true;  // обрывать ли пути с малым вкладом
+
+    // генератор сэмплов для смещения внутри пикселя и отскоков
+    sampler_kind sampling = sampler_kind::sobol;
+    uint32_t seed = 0;  // при одинаковом seed рендер воспроизводим
+
     float vfov = 90;  // задающий вертикальный угол обзора
 
     point3 lookfrom = point3(0, 0, 0);  // точка откуда смотрит камера
@@ -28,75 +39,8 @@ class camera {
 
     float focus_dist = 10;  // расстояние от камеры до холста
 
-    void render(const hittable &world) {
-        initialize();
-        std::vector<int> buffer(size_t(image_width) * image_height);
-
-        std::vector<std::thread> pool;
-        const auto thread_count = 16;
-        for (int k = 1; k < thread_count; k += 1) {
-            pool.emplace_back([k, this, &world, &buffer]() {
-                for (int i = k; i < image_height; i += thread_count) {
-                    for (int j = 0; j < image_width; ++j) {
-                        color c;
-                        // выпускается samples_per_pixel лучей для получения
-                        // информации о пикселе в i-ой строке j-ом столбце.
-                        // После цикла функция write_color поделит полученное
-                        // значение на количество отправленных лучей
-                        for (int k = 0; k < samples_per_pixel; ++k) {
-                            const auto r = get_ray(i, j);
-                            c += ray_color(r, max_depth, world);
-                        }
-                        buffer[i * image_width + j] =
-                            write_color(c, samples_per_pixel);
-                    }
-                }
-            });
-        }
-
-        // Отрисовка в файл
-        for (int i = 0; i < image_height; i += thread_count) {
-            std::clog << "\rScanlines remaining: " << (image_height - i) << ' '
-                      << std::flush;
-            for (int j = 0; j < image_width; ++j) {
-                color c;
-                for (int k = 0; k < samples_per_pixel; ++k) {
-                    const auto r = get_ray(i, j);
-                    c += ray_color(r, max_depth, world);
-                }
-                buffer[i * image_width + j] = write_color(c, samples_per_pixel);
-            }
-        }
-        std::clog << "\rDone.                 \n";
-        for (auto &th : pool) {
-            th.join();
-        }
-
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-        for (auto rgb : buffer) {
-            auto b = rgb % 256;
-            rgb >>= 8;
-            auto g = rgb % 256;
-            rgb >>= 8;
-            auto r = rgb % 256;
-            std::cout << r << ' ' << g << ' ' << b << '\n';
-        }
-    }
-
- private:
-    int image_height;
-    point3 camera_center;
-    point3 p00_position;  // позиция верхнего левого пикселя холста в сцене
-    vec3 delta_u;
-    vec3 delta_v;
-
-    // За деталями см. рисунок 10
-    vec3 w, u, v;  // Базисные векторы камеры
-
-    // w - направление взгляда
-    // v - направление верха
-    // u - направление права
-
+    // вычисляет параметры холста по настройкам выше. Должна вызываться
+    // после изменения настроек и перед render_pixel
     void initialize() {
         image_height = static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
@@ -129,48 +73,360 @@ class camera {
 
         p00_position =
             viewport_center - v_u / 2 - v_v / 2 + delta_u / 2 + delta_v / 2;
+
+        // угол, под которым из камеры виден один пиксель
+        pixel_spread = viewport_height / image_height / focus_dist;
+    }
+
+    [[nodiscard]] int get_image_height() const {
+        return image_height;
+    }
+
+    // дает ли камера other те же сэмплы в тех же пикселях: совпадают
+    // положение, объектив, размер кадра и все настройки трассировки
+    [[nodiscard]] bool same_rendering(const camera &other) const {
+        const auto same = [](const vec3 &a, const vec3 &b) {
+            return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+        };
+        return image_width == other.image_width &&
+               aspect_ratio == other.aspect_ratio &&
+               samples_per_pixel == other.samples_per_pixel &&
+               max_depth == other.max_depth && min_depth == other.min_depth &&
+               russian_roulette == other.russian_roulette &&
+               sampling == other.sampling && seed == other.seed &&
+               vfov == other.vfov && same(lookfrom, other.lookfrom) &&
+               same(lookat, other.lookat) && same(vup, other.vup) &&
+               focus_dist == other.focus_dist;
+    }
+
+    // Возвращает сумму цветов samples_per_pixel лучей, выпущенных в пиксель
+    // в i-ой строке j-ом столбце. Функция write_color затем поделит ее на
+    // количество отправленных лучей. В bounces прибавляется количество
+    // посчитанных пересечений. Если aov не nullptr, в него записываются
+    // усредненные по сэмплам AOV (глубина - только по попавшим в сцену
+    // сэмплам). Если задан cache, лучи стреляют в центры страт пикселя, а
+    // первые пересечения берутся из кэша. Если задан footprint, в него
+    // добавляется все, чего касались пути. Если задан guiding, отскоки
+    // направляются обученным распределением и, при наличии recorder, пути
+    // записываются для обучения
+    color render_pixel(int i,
+                       int j,
+                       const hittable &world,
+                       sampler &s,
+                       long long &bounces,
+                       surface_aov *aov = nullptr,
+                       primary_hit_cache *cache = nullptr,
+                       path_footprint *footprint = nullptr,
+                       const path_guiding *guiding = nullptr) const {
+        color c;
+        surface_aov aov_sum;
+        int aov_hits = 0;
+        for (int k = 0; k < samples_per_pixel; ++k) {
+            s.start_pixel_sample(i, j, k);
+            surface_aov sample_aov;
+            auto *sample_aov_ptr = aov != nullptr ? &sample_aov : nullptr;
+            if (cache != nullptr) {
+                // измерения смещения внутри пикселя все равно занимаются,
+                // чтобы отскоки получали те же измерения, что и без кэша
+                (void)s.get_2d();
+                const int stratum = k % cache->strata();
+                const auto r =
+                    get_stratum_ray(i, j, stratum, cache->strata_per_axis());
+                auto &primary = cache->at(i, j, stratum);
+                if (!cache->filled(i, j, stratum)) {
+                    hit_record rec;
+                    const bool is_hit =
+                        world.hit(r, interval(0.001, infinity), rec);
+                    primary = primary_hit(is_hit, rec);
+                    cache->mark_filled(i, j, stratum);
+                }
+                c += ray_color(r,
+                               max_depth,
+                               world,
+                               s,
+                               bounces,
+                               sample_aov_ptr,
+                               &primary,
+                               footprint,
+                               guiding);
+            } else {
+                const auto r = get_ray(i, j, s);
+                c += ray_color(r,
+                               max_depth,
+                               world,
+                               s,
+                               bounces,
+                               sample_aov_ptr,
+                               nullptr,
+                               footprint,
+                               guiding);
+            }
+            aov_sum.albedo += sample_aov.albedo;
+            aov_sum.normal += sample_aov.normal;
+            // бесконечная глубина промаха в среднее не входит, иначе на
+            // силуэтах среднее тоже стало бы бесконечным
+            if (sample_aov.depth < infinity) {
+                aov_sum.depth += sample_aov.depth;
+                ++aov_hits;
+            }
+        }
+        if (aov != nullptr) {
+            const auto scale = 1.0f / samples_per_pixel;
+            *aov = {aov_sum.albedo * scale,
+                    aov_sum.normal * scale,
+                    aov_hits > 0 ? aov_sum.depth / static_cast<float>(aov_hits)
+                                 : infinity};
+        }
+        return c;
     }
 
+ private:
+    int image_height;
+    point3 camera_center;
+    point3 p00_position;  // позиция верхнего левого пикселя холста в сцене
+    vec3 delta_u;
+    vec3 delta_v;
+    float pixel_spread = 0;
+
+    // За деталями см. рисунок 10
+    vec3 w, u, v;  // Базисные векторы камеры
+
+    // w - направление взгляда
+    // v - направление верха
+    // u - направление права
+
     // Генерирует луч, пускаемый в холст для получения информации о цвете
     // пикселя, находящегося в i-ой строке в j-ом столбце. К направлению
     // луча подмешивается шум
-    ray get_ray(int i, int j) {
+    ray get_ray(int i, int j, sampler &s) const {
+        const auto shooting_pos = p00_position + delta_u * j + delta_v * i;
+        const auto sampled_shooting_pos =
+            shooting_pos + pixel_sample_suquare(s);
+        return ray(camera_center, sampled_shooting_pos - camera_center);
+    }
+
+    // луч в центр страты stratum пикселя, разбитого на n x n страт
+    [[nodiscard]] ray get_stratum_ray(int i, int j, int stratum, int n) const {
         const auto shooting_pos = p00_position + delta_u * j + delta_v * i;
-        const auto sampled_shooting_pos = shooting_pos + pixel_sample_suquare();
+        const auto su = (static_cast<float>(stratum % n) + 0.5f) / n - 0.5f;
+        const auto sv = (static_cast<float>(stratum / n) + 0.5f) / n - 0.5f;
+        const auto sampled_shooting_pos =
+            shooting_pos + delta_u * su + delta_v * sv;
         return ray(camera_center, sampled_shooting_pos - camera_center);
     }
 
-    // генерация случайное отклонение для отправляемого луча
-    vec3 pixel_sample_suquare() {
-        return delta_u / 2 * random_float() + delta_v / 2 * random_float();
+    // генерация отклонения для отправляемого луча в пределах всего пикселя
+    // (от -1/2 до 1/2 шага по каждой оси относительно центра)
+    vec3 pixel_sample_suquare(sampler &s) const {
+        const auto u = s.get_2d();
+        return delta_u * (u.x - 0.5f) + delta_v * (u.y - 0.5f);
     }
 
-    // отображает объект world на экране
-    [[nodiscard]] color
-    ray_color(ray r, const int max_depth, const hittable &world) const {
+    // отображает объект world на экране. В bounces прибавляется количество
+    // пересечений, посчитанных для этого луча. Если aov не nullptr, в него
+    // записываются данные о первом пересечении. Если задан primary, первое
+    // пересечение берется из него, а не ищется заново. В footprint
+    // добавляются объекты, материалы и точки всех пересечений пути
+    [[nodiscard]] color ray_color(ray r,
+                                  const int max_depth,
+                                  const hittable &world,
+                                  sampler &s,
+                                  long long &bounces,
+                                  surface_aov *aov = nullptr,
+                                  const primary_hit *primary = nullptr,
+                                  path_footprint *footprint = nullptr,
+                                  const path_guiding *guiding = nullptr) const {
+        auto *recorder = guiding != nullptr ? guiding->recorder : nullptr;
+        if (recorder != nullptr) {
+            recorder->start_path();
+        }
         color cumulative_attenuation(1.0, 1.0, 1.0);
+        // ослабление, по которому решает русская рулетка. Без направленного
+        // семплирования совпадает с cumulative_attenuation, а на
+        // направленных отскоках в него идет ослабление, которое дало бы
+        // семплирование BSDF. Иначе направления к яркому свету, выбранные
+        // по распределению и потому получившие малый вес, почти всегда
+        // обрывались бы рулеткой
+        color roulette_attenuation(1.0, 1.0, 1.0);
+        // завершает путь, по последнему лучу которого пришла яркость radiance
+        const auto end_path = [&](const color &radiance) {
+            if (recorder != nullptr) {
+                recorder->finish_path(radiance);
+            }
+            return cumulative_attenuation * radiance;
+        };
+        float travelled = 0;  // длина пути от камеры
         int i = 0;
         for (; i < max_depth; ++i) {
+            ++bounces;
             hit_record rec;
-            if (!world.hit(r, interval(0.001, infinity), rec)) {
+            bool is_hit;
+            if (i == 0 && primary != nullptr) {
+                rec = primary->record();
+                is_hit = primary->is_hit;
+            } else {
+                is_hit = world.hit(r, interval(0.001, infinity), rec);
+            }
+            if (!is_hit) {
                 vec3 unit_direction = unit_vector(r.direction());
                 float a = 0.5f * (unit_direction.y() + 1.0f);
-                return cumulative_attenuation *
-                       ((1.0f - a) * color(1.0, 1.0, 1.0) +
-                        a * color(0.5, 0.7, 1.0));
+                const auto sky =
+                    (1.0f - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+                if (aov != nullptr && i == 0) {
+                    *aov = {sky, vec3(), infinity};
+                }
+                return end_path(sky);
+            }
+            if (footprint != nullptr) {
+                footprint->add_object(rec.object_id);
+                footprint->add_material(rec.mat.get());
+                footprint->add_point(r.at(rec.t));
             }
+            const auto segment = rec.t * r.direction().length();
+            travelled += segment;
+            // Вместо дифференциалов лучей используется конус луча: его
+            // ширина растет линейно с пройденным путем, а на наклонной
+            // поверхности след вытягивается в 1 / cos раз
+            const auto cos_theta =
+                std::abs(dot(r.direction(), rec.normal)) /
+                r.direction().length();
+            rec.uv_footprint = pixel_spread * travelled * rec.uv_scale /
+                               std::max(cos_theta, 0.1f);
+
             color attenuation;
             ray scattered;
-            if (rec.mat->scatter(r, rec, attenuation, scattered)) {
+            float pdf = 0;
+            float bsdf_pdf = 0;
+            const bool guided = guiding != nullptr && rec.mat->has_density();
+            const bool is_scattered =
+                guided
+                    ? guided_scatter(r,
+                                     rec,
+                                     s,
+                                     guiding->guide,
+                                     attenuation,
+                                     scattered,
+                                     pdf,
+                                     bsdf_pdf,
+                                     recorder != nullptr)
+                    : rec.mat->scatter(r, rec, s, attenuation, scattered);
+            // направленный отскок может не состояться (направление из
+            // распределения ушло под поверхность), но альбедо у материала
+            // от этого не меняется
+            if (aov != nullptr && i == 0) {
+                *aov = {guided ? albedo(r, rec) : attenuation,
+                        rec.normal,
+                        segment};
+            }
+            if (is_scattered) {
                 cumulative_attenuation = cumulative_attenuation * attenuation;
+                roulette_attenuation =
+                    roulette_attenuation *
+                    (guided ? attenuation * (pdf / bsdf_pdf) : attenuation);
+                if (recorder != nullptr) {
+                    recorder->add_vertex(rec.p,
+                                         unit_vector(scattered.direction()),
+                                         pdf,
+                                         attenuation);
+                }
                 r = scattered;
             } else if (!attenuation.near_zero()) {
-                return cumulative_attenuation * attenuation;
+                return end_path(attenuation);
             } else {
-                return color(0, 0, 0);
+                return end_path(color(0, 0, 0));
+            }
+
+            // Русская рулетка: после min_depth отскоков путь продолжается
+            // с вероятностью, равной наибольшей компоненте накопленного
+            // ослабления или roulette_attenuation. Выжившие пути делятся на
+            // эту вероятность, поэтому оценка остается несмещенной, а пути
+            // с малым вкладом обрываются
+            if (russian_roulette && i + 1 >= min_depth) {
+                const auto survival = std::min(
+                    1.0f,
+                    std::max({cumulative_attenuation.x(),
+                              cumulative_attenuation.y(),
+                              cumulative_attenuation.z(),
+                              roulette_attenuation.x(),
+                              roulette_attenuation.y(),
+                              roulette_attenuation.z()}));
+                if (s.get_1d() >= survival) {
+                    return end_path(color(0, 0, 0));
+                }
+                cumulative_attenuation /= survival;
+                roulette_attenuation /= survival;
+                if (recorder != nullptr) {
+                    recorder->survived(survival);
+                }
             }
         }
-        return color(0, 0, 0);
+        return end_path(color(0, 0, 0));
+    }
+
+    // отскок от материала с плотностью при направленном семплировании. С
+    // вероятностью guide_fraction направление берется из распределения
+    // guide для точки пересечения, иначе из scatter материала. Ослабление
+    // делится на плотность смеси обеих стратегий (one-sample MIS), поэтому
+    // оценка остается несмещенной при любом качестве распределения. В pdf
+    // записывается плотность смеси для выбранного направления, в bsdf_pdf -
+    // плотность scatter материала для него. Без need_pdf в необученных
+    // ячейках плотности не вычисляются, и обе равны 1
+    bool guided_scatter(const ray &r_in,
+                        const hit_record &rec,
+                        sampler &s,
+                        const path_guide *guide,
+                        color &attenuation,
+                        ray &scattered,
+                        float &pdf,
+                        float &bsdf_pdf,
+                        bool need_pdf) const {
+        const auto *distribution =
+            guide != nullptr ? guide->find(rec.p) : nullptr;
+        const auto fraction =
+            distribution != nullptr ? guide->guide_fraction() : 0.0f;
+        // измерение выбора занимается всегда, чтобы число измерений на
+        // отскок не зависело от того, обучена ли ячейка
+        const auto choice = s.get_1d();
+        if (distribution == nullptr && !need_pdf) {
+            // необученная ячейка вне обучения: обычный отскок, плотность
+            // смеси равна плотности BSDF и нигде не нужна
+            pdf = bsdf_pdf = 1;
+            return rec.mat->scatter(r_in, rec, s, attenuation, scattered);
+        }
+        vec3 direction;
+        float guide_pdf = 0;
+        if (choice < fraction) {
+            direction = distribution->sample(s.get_2d(), guide_pdf);
+        } else {
+            if (!rec.mat->scatter(r_in, rec, s, attenuation, scattered)) {
+                return false;
+            }
+            direction = unit_vector(scattered.direction());
+            if (distribution != nullptr) {
+                guide_pdf = distribution->pdf(direction);
+            }
+        }
+
+        color f_cos;
+        rec.mat->evaluate(r_in, rec, direction, f_cos, bsdf_pdf);
+        pdf = (1 - fraction) * bsdf_pdf + fraction * guide_pdf;
+        if (!(bsdf_pdf > 0) || !(pdf > 0)) {
+            // направление под поверхностью ничего не приносит
+            attenuation = color(0, 0, 0);
+            pdf = 0;
+            return false;
+        }
+        attenuation = f_cos / pdf;
+        scattered = ray(rec.p, direction);
+        return true;
+    }
+
+    // альбедо материала с плотностью для AOV: BSDF * cos / pdf вдоль нормали
+    static color albedo(const ray &r_in, const hit_record &rec) {
+        color f_cos;
+        float pdf;
+        rec.mat->evaluate(r_in, rec, rec.normal, f_cos, pdf);
+        return pdf > 0 ? f_cos / pdf : color(0, 0, 0);
     }
 };
 
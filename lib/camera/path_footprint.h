@@ -0,0 +1,223 @@
+#ifndef PATH_FOOTPRINT_H
+#define PATH_FOOTPRINT_H
+
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+class material;
+
+// Правка сцены между двумя рендерами. Перечисляются идентификаторы
+// измененных, перемещенных и удаленных объектов (hit_record::object_id),
+// измененные материалы и области, куда объекты были добавлены или
+// перемещены
+struct scene_edit {
+    struct region {
+        point3 center;
+        float radius;
+    };
+
+    std::vector<uint64_t> objects;
+    std::vector<const material *> materials;
+    std::vector<region> regions;
+
+    void object(uint64_t id) {
+        objects.push_back(id);
+    }
+
+    void changed(const material *mat) {
+        materials.push_back(mat);
+    }
+
+    // область, в которой теперь находится объект. Радиус стоит брать с
+    // запасом, чтобы в него попала и тень объекта на соседние поверхности
+    void moved_to(const point3 &center, float radius) {
+        regions.push_back({center, radius});
+    }
+
+    [[nodiscard]] bool empty() const {
+        return objects.empty() && materials.empty() && regions.empty();
+    }
+};
+
+// То, чего касались пути одного тайла: объекты, материалы и ячейки сетки
+// со стороной cell_size, в которые попали точки пересечений. Пока тайл
+// рисуется, ключи копятся в списках, а finish() сворачивает каждый вид
+// ключей в свой блум-фильтр с bits_per_key битами на различный ключ.
+// Поэтому доля ложных срабатываний не растет с длиной путей тайла, а
+// запросы по объектам и материалам не задевают биты ячеек, которых обычно
+// на порядок больше. Ложные срабатывания возможны и приводят к лишней
+// перерисовке, пропусков нет.
+//
+// Ячейки ловят правки, которые пути тайла не видели напрямую: объект,
+// перемещенный туда, где путь касался пола, перекроет ему свет. Но если
+// путь в старом рендере прошел сквозь новое место объекта, ни во что там
+// не попав (например, отражение неба в зеркале), тайл не перерисуется.
+// После таких правок нужен полный рендер
+class path_footprint {
+ public:
+    // при 5 проверках на ключ ложных срабатываний не больше 0.03%
+    static constexpr size_t bits_per_key = 24;
+
+    explicit path_footprint(float cell_size = 1) : cell_size_(cell_size) {
+    }
+
+    [[nodiscard]] float cell_size() const {
+        return cell_size_;
+    }
+
+    void clear() {
+        objects_.clear();
+        materials_.clear();
+        cells_.clear();
+    }
+
+    void add_object(uint64_t id) {
+        objects_.add(key(object_tag, id));
+    }
+
+    void add_material(const material *mat) {
+        materials_.add(key(material_tag, reinterpret_cast<uintptr_t>(mat)));
+    }
+
+    void add_point(const point3 &p) {
+        cells_.add(cell_key(cell(p.x()), cell(p.y()), cell(p.z())));
+    }
+
+    // строит фильтры по накопленным ключам. Вызывается, когда тайл
+    // дорисован, до копирования и до touched_by
+    void finish() {
+        objects_.finish();
+        materials_.finish();
+        cells_.finish();
+    }
+
+    // могла ли правка изменить пиксели тайла
+    [[nodiscard]] bool touched_by(const scene_edit &edit) const {
+        for (const auto id : edit.objects) {
+            if (objects_.contains(key(object_tag, id))) {
+                return true;
+            }
+        }
+        for (const auto *mat : edit.materials) {
+            if (materials_.contains(
+                    key(material_tag, reinterpret_cast<uintptr_t>(mat)))) {
+                return true;
+            }
+        }
+        for (const auto &r : edit.regions) {
+            const auto x0 = cell(r.center.x() - r.radius);
+            const auto y0 = cell(r.center.y() - r.radius);
+            const auto z0 = cell(r.center.z() - r.radius);
+            const auto x1 = cell(r.center.x() + r.radius);
+            const auto y1 = cell(r.center.y() + r.radius);
+            const auto z1 = cell(r.center.z() + r.radius);
+            // область слишком велика для перебора ячеек
+            if (int64_t(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1) >
+                max_region_cells) {
+                return true;
+            }
+            for (auto x = x0; x <= x1; ++x) {
+                for (auto y = y0; y <= y1; ++y) {
+                    for (auto z = z0; z <= z1; ++z) {
+                        if (cells_.contains(cell_key(x, y, z))) {
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+ private:
+    static constexpr uint64_t object_tag = 0x9e3779b97f4a7c15ull;
+    static constexpr uint64_t material_tag = 0xc2b2ae3d27d4eb4full;
+    static constexpr uint64_t cell_tag = 0x165667b19e3779f9ull;
+    static constexpr int64_t max_region_cells = 1 << 15;
+
+    // блум-фильтр одного вида ключей. Размер - степень двойки не меньше
+    // bits_per_key на различный ключ, позиции битов получаются двойным
+    // хэшированием из двух половин ключа
+    class filter {
+     public:
+        void clear() {
+            keys_.clear();
+            words_.clear();
+        }
+
+        void add(uint64_t k) {
+            keys_.push_back(k);
+        }
+
+        void finish() {
+            std::sort(keys_.begin(), keys_.end());
+            keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+            size_t bits = 64;
+            while (bits < keys_.size() * bits_per_key) {
+                bits *= 2;
+            }
+            words_.assign(keys_.empty() ? 0 : bits / 64, 0);
+            for (const auto k : keys_) {
+                for_each_bit(k, [this](uint64_t bit) {
+                    words_[bit / 64] |= uint64_t(1) << (bit % 64);
+                    return true;
+                });
+            }
+            // память под ключи остается для следующего тайла, а копии
+            // фильтра получают пустой список
+            keys_.clear();
+        }
+
+        [[nodiscard]] bool contains(uint64_t k) const {
+            return !words_.empty() && for_each_bit(k, [this](uint64_t bit) {
+                return (words_[bit / 64] >> (bit % 64) & 1) != 0;
+            });
+        }
+
+     private:
+        static constexpr int probes = 5;
+
+        std::vector<uint64_t> keys_;  // ключи тайла до finish()
+        std::vector<uint64_t> words_;
+
+        // вызывает visit для каждого бита ключа, пока она возвращает true
+        template <typename visitor>
+        bool for_each_bit(uint64_t k, visitor visit) const {
+            const uint64_t mask = words_.size() * 64 - 1;
+            const uint64_t step = (k >> 32) | 1;
+            for (int i = 0; i < probes; ++i) {
+                if (!visit((k + i * step) & mask)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    float cell_size_;
+    filter objects_;
+    filter materials_;
+    filter cells_;
+
+    [[nodiscard]] int32_t cell(float x) const {
+        return static_cast<int32_t>(std::floor(x / cell_size_));
+    }
+
+    // перемешивание splitmix64
+    static uint64_t key(uint64_t tag, uint64_t value) {
+        auto z = value + tag;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    static uint64_t cell_key(int32_t x, int32_t y, int32_t z) {
+        return key(cell_tag,
+                   key(uint32_t(x), uint64_t(uint32_t(y)) << 32 | uint32_t(z)));
+    }
+};
+
+#endif
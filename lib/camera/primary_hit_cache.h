@@ -0,0 +1,166 @@
+#ifndef PRIMARY_HIT_CACHE_H
+#define PRIMARY_HIT_CACHE_H
+
+#include "hittable.h"
+#include "ray.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Первое пересечение луча из камеры в сжатом виде: только поля, которые
+// нужны ray_color. Сам луч не хранится, камера строит его заново по номеру
+// страты. Материал хранится без владения, поэтому чтение записи не трогает
+// атомарный счетчик ссылок. Материалы принадлежат сцене, которая должна
+// жить, пока записи не сброшены
+struct primary_hit {
+    point3 p;
+    vec3 normal;
+    float t = 0;
+    float u = 0;
+    float v = 0;
+    float uv_scale = 0;
+    uint64_t object_id = 0;
+    material *mat = nullptr;
+    bool front_face = false;
+    bool is_hit = false;
+
+    primary_hit() = default;
+
+    primary_hit(bool hit, const hit_record &rec)
+        : p(rec.p),
+          normal(rec.normal),
+          t(rec.t),
+          u(rec.u),
+          v(rec.v),
+          uv_scale(rec.uv_scale),
+          object_id(rec.object_id),
+          mat(rec.mat.get()),
+          front_face(rec.front_face),
+          is_hit(hit) {
+    }
+
+    // запись пересечения. mat в ней не владеет материалом
+    [[nodiscard]] hit_record record() const {
+        hit_record rec;
+        rec.p = p;
+        rec.normal = normal;
+        rec.t = t;
+        rec.mat = shared_ptr<material>(shared_ptr<material>(), mat);
+        rec.front_face = front_face;
+        rec.u = u;
+        rec.v = v;
+        rec.uv_scale = uv_scale;
+        rec.object_id = object_id;
+        return rec;
+    }
+};
+
+// G-буфер первых пересечений. Каждый пиксель делится на
+// strata_per_axis x strata_per_axis страт, и k-ый сэмпл пикселя стреляет в
+// центр страты k % strata(). Первое пересечение каждой страты ищется один
+// раз, все остальные сэмплы и последующие проходы с той же камерой и сценой
+// начинают трассировку сразу с него.
+//
+// strata_per_axis выбирается в resize по числу сэмплов на пиксель: самое
+// большое n не больше max_strata_per_axis, для которого samples_per_pixel
+// делится на n * n. Тогда все страты получают поровну сэмплов. Иначе при 4
+// сэмплах и 4x4 стратах использовалась бы только верхняя строка страт, и
+// изображение сдвигалось бы вверх на 3/8 пикселя без сглаживания по
+// вертикали. Число сэмплов, не делящееся на 4, дает одну страту в центре.
+//
+// Сглаживание границ ограничено центрами страт, и эта ошибка не убывает с
+// ростом числа сэмплов. Кэш окупается, только если сэкономленное время
+// дает больше, чем теряется на сглаживании. На демо-сцене при 160px и
+// 64 сэмплах без кэша получается RMSE 3.0 за 9.6 с. Со страт 4x4 -
+// 3.4 за 6.4 с, а рендер без кэша за то же время (около 43 сэмплов) дал
+// бы около 3.7. С 2x2 - 5.0 за 5.5 с против примерно 3.9 без кэша, то есть
+// проигрыш. Поэтому по умолчанию max_strata_per_axis = 4, а меньше страт
+// имеет смысл брать только для повторных проходов с той же камерой, где
+// лучи из камеры не трассируются вовсе.
+//
+// Запись занимает 64 байта, и память выделяется только под используемые
+// страты: при 4x4 это 1 КиБ на пиксель (около 2 ГиБ для 1920x1080), при
+// 2x2 - 256 байт.
+//
+// После изменения камеры или сцены кэш нужно сбросить через clear() или
+// invalidate() для затронутых пикселей. Одновременно кэш может
+// использовать только один рендер
+class primary_hit_cache {
+ public:
+    explicit primary_hit_cache(int max_strata_per_axis = 4)
+        : max_strata_per_axis_(std::max(1, max_strata_per_axis)) {
+    }
+
+    [[nodiscard]] int max_strata_per_axis() const {
+        return max_strata_per_axis_;
+    }
+
+    // страт по оси для текущего числа сэмплов, см. resize
+    [[nodiscard]] int strata_per_axis() const {
+        return strata_per_axis_;
+    }
+
+    [[nodiscard]] int strata() const {
+        return strata_per_axis_ * strata_per_axis_;
+    }
+
+    // подготавливает кэш для изображения width x height с
+    // samples_per_pixel сэмплами на пиксель. Если размер или число страт
+    // изменились, сохраненные пересечения сбрасываются
+    void resize(int width, int height, int samples_per_pixel) {
+        int strata_per_axis = max_strata_per_axis_;
+        while (strata_per_axis > 1 &&
+               samples_per_pixel % (strata_per_axis * strata_per_axis) != 0) {
+            --strata_per_axis;
+        }
+        if (width == width_ && height == height_ &&
+            strata_per_axis == strata_per_axis_) {
+            return;
+        }
+        width_ = width;
+        height_ = height;
+        strata_per_axis_ = strata_per_axis;
+        clear();
+    }
+
+    void clear() {
+        const auto size = size_t(width_) * height_ * strata();
+        hits_.assign(size, primary_hit());
+        filled_.assign(size, 0);
+    }
+
+    // пересечение для страты stratum пикселя в i-ой строке j-ом столбце.
+    // filled показывает, было ли оно уже посчитано
+    [[nodiscard]] primary_hit &at(int i, int j, int stratum) {
+        return hits_[index(i, j, stratum)];
+    }
+
+    [[nodiscard]] bool filled(int i, int j, int stratum) const {
+        return filled_[index(i, j, stratum)] != 0;
+    }
+
+    void mark_filled(int i, int j, int stratum) {
+        filled_[index(i, j, stratum)] = 1;
+    }
+
+    // сбрасывает пересечения всех страт пикселя, например после правки
+    // сцены, которая его затронула
+    void invalidate(int i, int j) {
+        const auto first = filled_.begin() + index(i, j, 0);
+        std::fill(first, first + strata(), 0);
+    }
+
+ private:
+    int max_strata_per_axis_;
+    int strata_per_axis_ = 1;
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<primary_hit> hits_;
+    std::vector<uint8_t> filled_;
+
+    [[nodiscard]] size_t index(int i, int j, int stratum) const {
+        return (size_t(i) * width_ + j) * strata() + stratum;
+    }
+};
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "color.h"
+#include "vec3.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Данные о первом пересечении луча из камеры (AOV, arbitrary output
+// variables). Для промаха albedo - цвет неба, нормаль нулевая, а глубина
+// равна infinity. В усредненных по пикселю AOV глубина - среднее по
+// попаданиям, и infinity остается только у пикселей без попаданий
+struct surface_aov {
+    color albedo;
+    vec3 normal;
+    float depth = 0;
+};
+
+// Усредненные по сэмплам AOV для всего изображения, построчно
+struct aov_buffers {
+    std::vector<color> albedo;
+    std::vector<vec3> normal;
+    std::vector<float> depth;
+
+    void resize(size_t size) {
+        albedo.assign(size, color());
+        normal.assign(size, vec3());
+        depth.assign(size, 0);
+    }
+};
+
+struct denoise_settings {
+    // количество проходов а-trous. Шаг i-го прохода равен 2^i пикселей,
+    // поэтому радиус фильтра после 5 проходов - 62 пикселя
+    int iterations = 5;
+    // чувствительность к разнице освещенности. На каждом проходе делится
+    // пополам, так как шум уже сглажен предыдущими проходами
+    float sigma_color = 1.0;
+    float sigma_normal = 0.5;  // к разнице нормалей
+    float sigma_albedo = 0.3;  // к разнице альбедо
+    float sigma_depth = 0.1;  // к относительной разнице глубин
+};
+
+namespace denoising {
+
+// exp(x) для x <= 0 с относительной ошибкой порядка 1e-4. В отличие от
+// std::exp не вызывает библиотечную функцию, поэтому внутренние циклы
+// фильтра векторизуются
+inline float fast_exp(float x) {
+    const auto t = std::max(x * 1.44269504f, -126.0f);
+    const auto truncated = static_cast<int32_t>(t);
+    const auto floor = truncated - (t < static_cast<float>(truncated) ? 1 : 0);
+    const auto f = t - static_cast<float>(floor);
+    // полином, приближающий 2^f на [0, 1)
+    const auto p =
+        1.0f +
+        f * (0.69314718f +
+             f * (0.24022650f + f * (0.05550411f + f * (0.00961813f +
+                                                         f * 0.00133336f))));
+    return std::bit_cast<float>(static_cast<int32_t>((floor + 127) << 23)) * p;
+}
+
+// Изображение, разложенное по каналам (structure of arrays) и дополненное
+// по краям копиями крайних пикселей. Благодаря полям чтение соседей не
+// требует проверок границ, и строка обрабатывается непрерывным циклом
+class padded_planes {
+ public:
+    padded_planes(int width, int height, int pad, int channels)
+        : width_(width), height_(height), pad_(pad),
+          stride_(width + 2 * pad),
+          plane_size_(size_t(stride_) * (height + 2 * pad)),
+          data_(plane_size_ * channels) {
+    }
+
+    [[nodiscard]] float *row(int channel, int y) {
+        return data_.data() + channel * plane_size_ +
+               size_t(y + pad_) * stride_ + pad_;
+    }
+
+    [[nodiscard]] const float *row(int channel, int y) const {
+        return data_.data() + channel * plane_size_ +
+               size_t(y + pad_) * stride_ + pad_;
+    }
+
+    // заполняет поля копиями крайних пикселей
+    void extend_borders() {
+        const auto channels = static_cast<int>(data_.size() / plane_size_);
+        for (int c = 0; c < channels; ++c) {
+            for (int y = 0; y < height_; ++y) {
+                auto *r = row(c, y);
+                std::fill(r - pad_, r, r[0]);
+                std::fill(r + width_, r + width_ + pad_, r[width_ - 1]);
+            }
+            for (int p = 1; p <= pad_; ++p) {
+                std::copy(row(c, 0) - pad_,
+                          row(c, 0) + width_ + pad_,
+                          row(c, -p) - pad_);
+                std::copy(row(c, height_ - 1) - pad_,
+                          row(c, height_ - 1) + width_ + pad_,
+                          row(c, height_ - 1 + p) - pad_);
+            }
+        }
+    }
+
+ private:
+    int width_;
+    int height_;
+    int pad_;
+    int stride_;
+    size_t plane_size_;
+    std::vector<float> data_;
+};
+
+// Каналы guide-изображения
+enum guide_channel {
+    albedo_r,
+    albedo_g,
+    albedo_b,
+    normal_x,
+    normal_y,
+    normal_z,
+    depth,
+    guide_channels
+};
+
+// Запускает body(y) для всех строк, распределяя их между потоками
+template <typename Body>
+void parallel_rows(int height, Body body) {
+    const auto thread_count = static_cast<int>(
+        std::max(1u, std::min(16u, std::thread::hardware_concurrency())));
+    std::vector<std::thread> pool;
+    for (int k = 1; k < thread_count; ++k) {
+        pool.emplace_back([k, thread_count, height, &body]() {
+            for (int y = k; y < height; y += thread_count) {
+                body(y);
+            }
+        });
+    }
+    for (int y = 0; y < height; y += thread_count) {
+        body(y);
+    }
+    for (auto &th : pool) {
+        th.join();
+    }
+}
+
+// Один проход edge-avoiding а-trous вейвлета (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering"): ядро
+// B3-сплайна 5x5 с шагом step, вес каждого соседа дополнительно умножается
+// на близость освещенности, нормали, альбедо и глубины
+inline void atrous_pass(const padded_planes &in,
+                        const padded_planes &guide,
+                        padded_planes &out,
+                        int width,
+                        int height,
+                        int step,
+                        const denoise_settings &settings,
+                        float sigma_color) {
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4,
+                                    1.0f / 16};
+    const auto inv_color = 1 / (sigma_color * sigma_color);
+    const auto inv_normal = 1 / (settings.sigma_normal * settings.sigma_normal);
+    const auto inv_albedo = 1 / (settings.sigma_albedo * settings.sigma_albedo);
+    const auto inv_depth = 1 / settings.sigma_depth;
+
+    parallel_rows(height, [&](int y) {
+        std::vector<float> sum(4 * size_t(width), 0);
+        float *sum_r = sum.data();
+        float *sum_g = sum_r + width;
+        float *sum_b = sum_g + width;
+        float *sum_w = sum_b + width;
+
+        const float *pr = in.row(0, y);
+        const float *pg = in.row(1, y);
+        const float *pb = in.row(2, y);
+        const float *par = guide.row(albedo_r, y);
+        const float *pag = guide.row(albedo_g, y);
+        const float *pab = guide.row(albedo_b, y);
+        const float *pnx = guide.row(normal_x, y);
+        const float *pny = guide.row(normal_y, y);
+        const float *pnz = guide.row(normal_z, y);
+        const float *pz = guide.row(depth, y);
+
+        for (int ky = 0; ky < 5; ++ky) {
+            const int qy = y + (ky - 2) * step;
+            for (int kx = 0; kx < 5; ++kx) {
+                const int dx = (kx - 2) * step;
+                const float h = kernel[ky] * kernel[kx];
+
+                const float *qr = in.row(0, qy) + dx;
+                const float *qg = in.row(1, qy) + dx;
+                const float *qb = in.row(2, qy) + dx;
+                const float *qar = guide.row(albedo_r, qy) + dx;
+                const float *qag = guide.row(albedo_g, qy) + dx;
+                const float *qab = guide.row(albedo_b, qy) + dx;
+                const float *qnx = guide.row(normal_x, qy) + dx;
+                const float *qny = guide.row(normal_y, qy) + dx;
+                const float *qnz = guide.row(normal_z, qy) + dx;
+                const float *qz = guide.row(depth, qy) + dx;
+
+#pragma omp simd
+                for (int x = 0; x < width; ++x) {
+                    const float dr = pr[x] - qr[x];
+                    const float dg = pg[x] - qg[x];
+                    const float db = pb[x] - qb[x];
+                    const float d_color = dr * dr + dg * dg + db * db;
+
+                    const float nx = pnx[x] - qnx[x];
+                    const float ny = pny[x] - qny[x];
+                    const float nz = pnz[x] - qnz[x];
+                    const float d_normal = nx * nx + ny * ny + nz * nz;
+
+                    const float ar = par[x] - qar[x];
+                    const float ag = pag[x] - qag[x];
+                    const float ab = pab[x] - qab[x];
+                    const float d_albedo = ar * ar + ag * ag + ab * ab;
+
+                    const float d_depth = std::abs(pz[x] - qz[x]) /
+                                          (std::max(pz[x], qz[x]) + 1e-4f);
+
+                    const float w =
+                        h * fast_exp(-d_color * inv_color -
+                                     d_normal * inv_normal -
+                                     d_albedo * inv_albedo -
+                                     d_depth * inv_depth);
+                    sum_r[x] += w * qr[x];
+                    sum_g[x] += w * qg[x];
+                    sum_b[x] += w * qb[x];
+                    sum_w[x] += w;
+                }
+            }
+        }
+
+        float *out_r = out.row(0, y);
+        float *out_g = out.row(1, y);
+        float *out_b = out.row(2, y);
+#pragma omp simd
+        for (int x = 0; x < width; ++x) {
+            // вес центрального пикселя всегда положителен
+            const float inv_w = 1 / sum_w[x];
+            out_r[x] = sum_r[x] * inv_w;
+            out_g[x] = sum_g[x] * inv_w;
+            out_b[x] = sum_b[x] * inv_w;
+        }
+    });
+}
+
+}  // namespace denoising
+
+// Убирает шум Монте-Карло из image (усредненные по сэмплам цвета) с
+// помощью AOV первого пересечения. Перед фильтрацией цвет делится на
+// альбедо, чтобы фильтровалось только освещение, а текстуры и границы
+// материалов оставались резкими
+inline void denoise(std::vector<color> &image,
+                    const aov_buffers &aovs,
+                    int width,
+                    int height,
+                    const denoise_settings &settings = {}) {
+    using namespace denoising;
+    if (settings.iterations <= 0 || width <= 0 || height <= 0) {
+        return;
+    }
+
+    const int pad = 2 << (settings.iterations - 1);
+    constexpr float min_albedo = 1e-3f;
+    // вместо бесконечной глубины промахов берется конечное число, чтобы не
+    // получить NaN в относительной разнице глубин
+    constexpr float max_depth = 1e6f;
+
+    padded_planes guide(width, height, pad, guide_channels);
+    padded_planes ping(width, height, pad, 3);
+    padded_planes pong(width, height, pad, 3);
+
+    parallel_rows(height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            const auto idx = size_t(y) * width + x;
+            const auto &a = aovs.albedo[idx];
+            const auto &n = aovs.normal[idx];
+            guide.row(albedo_r, y)[x] = a.x();
+            guide.row(albedo_g, y)[x] = a.y();
+            guide.row(albedo_b, y)[x] = a.z();
+            guide.row(normal_x, y)[x] = n.x();
+            guide.row(normal_y, y)[x] = n.y();
+            guide.row(normal_z, y)[x] = n.z();
+            guide.row(depth, y)[x] = std::min(aovs.depth[idx], max_depth);
+            for (int c = 0; c < 3; ++c) {
+                ping.row(c, y)[x] = image[idx][c] / std::max(a[c], min_albedo);
+            }
+        }
+    });
+    guide.extend_borders();
+
+    auto *src = &ping;
+    auto *dst = &pong;
+    auto sigma_color = settings.sigma_color;
+    for (int i = 0; i < settings.iterations; ++i) {
+        src->extend_borders();
+        atrous_pass(*src, guide, *dst, width, height, 1 << i, settings,
+                    sigma_color);
+        std::swap(src, dst);
+        sigma_color /= 2;
+    }
+
+    parallel_rows(height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            const auto idx = size_t(y) * width + x;
+            const auto &a = aovs.albedo[idx];
+            for (int c = 0; c < 3; ++c) {
+                image[idx][c] =
+                    src->row(c, y)[x] * std::max(a[c], min_albedo);
+            }
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,476 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "color.h"
+#include "common.h"
+#include "sampler.h"
+#include "vec3.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace guiding {
+
+// наибольшее float меньше 1, чтобы точки квадрата не выходили за [0, 1)
+inline constexpr float below_one =
+    1 - std::numeric_limits<float>::epsilon() / 2;
+
+// ключ ячейки уровня level пространственной сетки. Сторона ячейки
+// уровня - cell_size * 2^level
+inline uint64_t cell_key(const point3 &p, float cell_size, int level) {
+    const auto inverse = 1 / (cell_size * static_cast<float>(1 << level));
+    const auto x = static_cast<int32_t>(std::floor(p.x() * inverse));
+    const auto y = static_cast<int32_t>(std::floor(p.y() * inverse));
+    const auto z = static_cast<int32_t>(std::floor(p.z() * inverse));
+    return (uint64_t(uint32_t(x)) * 0x9e3779b97f4a7c15ull) ^
+           (uint64_t(uint32_t(y)) * 0xc2b2ae3d27d4eb4full) ^
+           (uint64_t(uint32_t(z)) * 0x165667b19e3779f9ull) ^
+           (uint64_t(level) * 0x94d049bb133111ebull);
+}
+
+// обратное к sample_unit_vector отображение: точка единичного квадрата,
+// равные площади которого соответствуют равным телесным углам
+inline point2 direction_to_square(const vec3 &unit_direction) {
+    auto phi = std::atan2(unit_direction.y(), unit_direction.x());
+    if (phi < 0) {
+        phi += 2 * static_cast<float>(pi);
+    }
+    return {std::clamp((1 - unit_direction.z()) / 2, 0.0f, below_one),
+            std::clamp(phi / (2 * static_cast<float>(pi)), 0.0f, below_one)};
+}
+
+}  // namespace guiding
+
+// Одна запись обучения: направление в координатах квадрата и оценка
+// пришедшей с него яркости, деленная на плотность выбора направления
+struct guide_record {
+    point2 direction;
+    float value;
+};
+
+// Статистика обучения одной ячейки сетки
+struct guide_statistics {
+    std::vector<guide_record> records;  // только с ненулевой яркостью
+    uint32_t samples = 0;  // все записи, включая пути без света
+    point3 point;  // любая из точек записей, лежит внутри ячейки
+};
+
+// Распределение направлений в одной ячейке сетки. Квадрат направлений
+// делится деревом квадрантов: узел делится, пока на него приходится больше
+// split_fraction всей яркости. Поэтому узкий источник света (например,
+// портал) получает мелкие листья, а направления без света - один крупный
+class guide_distribution {
+ public:
+    // доля равномерного распределения, чтобы плотность нигде не была
+    // нулевой и направления без статистики все равно выбирались
+    static constexpr float uniform_fraction = 0.1f;
+    static constexpr float split_fraction = 0.03f;
+    static constexpr int max_depth = 8;
+    static constexpr long min_split_records = 8;
+
+    // возвращает false, если статистика пустая
+    bool build(std::vector<guide_record> records) {
+        float total = 0;
+        for (const auto &r : records) {
+            total += r.value;
+        }
+        if (!(total > 0)) {
+            return false;
+        }
+        nodes_.assign(1, node{1, -1});
+        build_node(0, records.begin(), records.end(), total, 0, 0, 1, 0);
+        return true;
+    }
+
+    // направление по точке u единичного квадрата и его плотность по
+    // телесному углу
+    vec3 sample(point2 u, float &pdf) const {
+        if (u.x < uniform_fraction) {
+            const auto direction =
+                sample_unit_vector(u.x / uniform_fraction, u.y);
+            pdf = this->pdf(direction);
+            return direction;
+        }
+        // остаток u.x после каждого выбора снова равномерен на [0, 1)
+        auto rest = (u.x - uniform_fraction) / (1 - uniform_fraction);
+        float x0 = 0;
+        float y0 = 0;
+        float size = 1;
+        int32_t index = 0;
+        while (nodes_[index].children >= 0) {
+            const auto first = nodes_[index].children;
+            // доли потомков сравниваются в единицах всей яркости, без
+            // деления на долю родителя
+            const auto target = rest * nodes_[index].probability;
+            int quadrant = 0;
+            auto lo = 0.0f;
+            for (; quadrant < 3; ++quadrant) {
+                const auto p = nodes_[first + quadrant].probability;
+                if (target < lo + p) {
+                    break;
+                }
+                lo += p;
+            }
+            const auto p = nodes_[first + quadrant].probability;
+            rest = p > 0 ? std::clamp((target - lo) / p,
+                                      0.0f,
+                                      guiding::below_one)
+                         : 0.0f;
+            size /= 2;
+            x0 += size * static_cast<float>(quadrant & 1);
+            y0 += size * static_cast<float>(quadrant >> 1);
+            index = first + quadrant;
+        }
+        // плотность листа, в который попало направление, без повторного
+        // спуска по дереву
+        pdf = density(nodes_[index].probability, size);
+        return sample_unit_vector(x0 + size * rest, y0 + size * u.y);
+    }
+
+    [[nodiscard]] float pdf(const vec3 &unit_direction) const {
+        const auto u = guiding::direction_to_square(unit_direction);
+        float x0 = 0;
+        float y0 = 0;
+        float size = 1;
+        int32_t index = 0;
+        while (nodes_[index].children >= 0) {
+            size /= 2;
+            const int qx = u.x >= x0 + size ? 1 : 0;
+            const int qy = u.y >= y0 + size ? 1 : 0;
+            x0 += size * static_cast<float>(qx);
+            y0 += size * static_cast<float>(qy);
+            index = nodes_[index].children + qx + 2 * qy;
+        }
+        return density(nodes_[index].probability, size);
+    }
+
+ private:
+    struct node {
+        float probability;  // доля всей яркости
+        int32_t children;  // первый из четырех потомков или -1 у листа
+    };
+
+    std::vector<node> nodes_;
+
+    // плотность по телесному углу в листе со стороной size и долей
+    // яркости probability вместе с равномерной частью
+    static float density(float probability, float size) {
+        const auto tree = probability / (size * size);
+        return ((1 - uniform_fraction) * tree + uniform_fraction) /
+               (4 * static_cast<float>(pi));
+    }
+
+    using record_iterator = std::vector<guide_record>::iterator;
+
+    void build_node(int32_t index,
+                    record_iterator first,
+                    record_iterator last,
+                    float total,
+                    float x0,
+                    float y0,
+                    float size,
+                    int depth) {
+        if (depth >= max_depth || last - first < min_split_records ||
+            nodes_[index].probability <= split_fraction) {
+            return;
+        }
+        const auto half = size / 2;
+        const auto mid_y = std::partition(first, last, [&](const auto &r) {
+            return r.direction.y < y0 + half;
+        });
+        const auto mid_x0 = std::partition(first, mid_y, [&](const auto &r) {
+            return r.direction.x < x0 + half;
+        });
+        const auto mid_x1 = std::partition(mid_y, last, [&](const auto &r) {
+            return r.direction.x < x0 + half;
+        });
+        const std::array<record_iterator, 5> bounds{
+            first, mid_x0, mid_y, mid_x1, last};
+
+        const auto children = static_cast<int32_t>(nodes_.size());
+        nodes_[index].children = children;
+        for (int q = 0; q < 4; ++q) {
+            float energy = 0;
+            for (auto it = bounds[q]; it != bounds[q + 1]; ++it) {
+                energy += it->value;
+            }
+            nodes_.push_back({energy / total, -1});
+        }
+        for (int q = 0; q < 4; ++q) {
+            build_node(children + q,
+                       bounds[q],
+                       bounds[q + 1],
+                       total,
+                       x0 + half * static_cast<float>(q & 1),
+                       y0 + half * static_cast<float>(q >> 1),
+                       half,
+                       depth + 1);
+        }
+    }
+};
+
+// Направленное семплирование путей (path guiding) по пространственной сетке
+// распределений направлений. Во время обучающих проходов каждый поток
+// собирает в свой recorder, с какой яркостью свет приходил в точки
+// пересечений с разных направлений. Между проходами записи сливаются через
+// merge, а update строит по ним распределения. Во время прохода
+// распределения только читаются, поэтому потоки не синхронизируются.
+//
+// Распределения учитывают только входящую яркость, без BSDF, поэтому
+// камера выбирает направление смесью guide_fraction распределения и BSDF
+class path_guide {
+ public:
+    // уровни сетки: каждый следующий вдвое крупнее. Записи собираются в
+    // ячейки мелкого уровня, update объединяет их в крупные, а find берет
+    // самую мелкую ячейку, где записей хватило на распределение. Так часто
+    // посещаемые места получают точные распределения, а редкие - грубые
+    static constexpr int levels = 3;
+    // ненулевых записей на распределение ячейки
+    static constexpr size_t min_records = 32;
+
+    class recorder {
+     public:
+        explicit recorder(float cell_size) : cell_size_(cell_size) {
+        }
+
+        // начинает запись нового пути
+        void start_path() {
+            path_.clear();
+        }
+
+        // отскок в точке p в нормированном направлении direction, выбранном
+        // с плотностью pdf, с ослаблением weight. Вершины с pdf = 0 только
+        // передают ослабление и не обучают распределение
+        void add_vertex(const point3 &p,
+                        const vec3 &direction,
+                        float pdf,
+                        const color &weight) {
+            path_.push_back({p, direction, pdf, weight, 1});
+        }
+
+        // путь после последней вершины продолжен русской рулеткой с
+        // вероятностью survival
+        void survived(float survival) {
+            if (!path_.empty()) {
+                path_.back().continuation /= survival;
+            }
+        }
+
+        // путь закончился, и по последнему лучу пришла яркость radiance.
+        // Для каждой вершины записывается яркость, пришедшая в нее по
+        // выбранному направлению
+        void finish_path(const color &radiance) {
+            auto incoming = radiance;
+            for (auto it = path_.rbegin(); it != path_.rend(); ++it) {
+                incoming *= it->continuation;
+                if (it->pdf > 0) {
+                    add(it->p, it->direction, luminance(incoming), it->pdf);
+                }
+                incoming = incoming * it->weight;
+            }
+            path_.clear();
+        }
+
+        // в точку p с направления direction пришла яркость radiance,
+        // направление было выбрано с плотностью pdf
+        void add(const point3 &p,
+                 const vec3 &unit_direction,
+                 float radiance,
+                 float pdf) {
+            auto &cell = cells_[guiding::cell_key(p, cell_size_, 0)];
+            ++cell.samples;
+            cell.point = p;
+            if (pdf > 0 && radiance > 0) {
+                cell.records.push_back(
+                    {guiding::direction_to_square(unit_direction),
+                     std::min(radiance / pdf, max_record)});
+            }
+        }
+
+     private:
+        friend class path_guide;
+
+        // ограничение одной записи, чтобы редкие яркие пути не делали
+        // распределение вырожденным
+        static constexpr float max_record = 1e3f;
+
+        struct vertex {
+            point3 p;
+            vec3 direction;
+            float pdf;
+            color weight;
+            float continuation;  // 1 / вероятность продолжения пути
+        };
+
+        float cell_size_;
+        std::unordered_map<uint64_t, guide_statistics> cells_;
+        std::vector<vertex> path_;
+
+        static float luminance(const color &c) {
+            return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+        }
+    };
+
+    // не больше max_cell_records записей с ненулевой яркостью хранится на
+    // ячейку, остальные только учитываются в samples
+    static constexpr size_t max_cell_records = size_t(1) << 14;
+
+    explicit path_guide(float cell_size = 1, float guide_fraction = 0.5f)
+        : cell_size_(cell_size), guide_fraction_(guide_fraction) {
+    }
+
+    path_guide(const path_guide &) = delete;
+    path_guide &operator=(const path_guide &) = delete;
+
+    [[nodiscard]] float cell_size() const {
+        return cell_size_;
+    }
+
+    // доля направлений, выбираемых по распределению, а не по BSDF
+    [[nodiscard]] float guide_fraction() const {
+        return guide_fraction_;
+    }
+
+    [[nodiscard]] recorder make_recorder() const {
+        return recorder(cell_size_);
+    }
+
+    // добавляет записи потока к общей статистике. Потокобезопасна
+    void merge(const recorder &r) {
+        std::lock_guard lock(merge_mutex_);
+        for (const auto &[key, cell] : r.cells_) {
+            auto &total = statistics_[key];
+            total.samples += cell.samples;
+            total.point = cell.point;
+            append_records(total.records, cell.records);
+        }
+    }
+
+    // перестраивает распределения по всей накопленной статистике. Ячейки,
+    // в которые попало меньше min_samples записей, не направляются.
+    // Вызывается между проходами, когда никто не читает распределения
+    void update(uint32_t min_samples = 16) {
+        std::lock_guard lock(merge_mutex_);
+        distributions_.clear();
+        const auto build = [&](uint64_t key, const guide_statistics &cell) {
+            guide_distribution d;
+            if (cell.samples >= min_samples &&
+                cell.records.size() >= min_records && d.build(cell.records)) {
+                distributions_.emplace(key, std::move(d));
+            }
+        };
+        // статистика хранится только для мелкого уровня, крупные
+        // собираются из нее здесь, а не при каждой записи
+        std::unordered_map<uint64_t, guide_statistics> coarse;
+        for (const auto &[key, cell] : statistics_) {
+            build(key, cell);
+            for (int level = 1; level < levels; ++level) {
+                auto &total =
+                    coarse[guiding::cell_key(cell.point, cell_size_, level)];
+                total.samples += cell.samples;
+                total.point = cell.point;
+                append_records(total.records, cell.records);
+            }
+        }
+        for (const auto &[key, cell] : coarse) {
+            build(key, cell);
+        }
+        // уровень для каждой ячейки мелкого уровня выбирается здесь один
+        // раз, чтобы find обходился одним поиском
+        size_t capacity = 2;
+        finest_shift_ = 63;
+        while (capacity < 2 * statistics_.size()) {
+            capacity *= 2;
+            --finest_shift_;
+        }
+        finest_.assign(capacity, finest_cell{});
+        for (const auto &[key, cell] : statistics_) {
+            auto i = finest_slot(key);
+            while (finest_[i].used) {
+                i = (i + 1) & (capacity - 1);
+            }
+            finest_[i] = {key, find_in_levels(cell.point, 0), true};
+        }
+    }
+
+    // распределение для точки p или nullptr, если его еще нет
+    [[nodiscard]] const guide_distribution *find(const point3 &p) const {
+        if (distributions_.empty()) {
+            return nullptr;
+        }
+        const auto key = guiding::cell_key(p, cell_size_, 0);
+        // таблица заполнена не больше чем наполовину, пустой слот есть
+        for (auto i = finest_slot(key); finest_[i].used;
+             i = (i + 1) & (finest_.size() - 1)) {
+            if (finest_[i].key == key) {
+                return finest_[i].distribution;
+            }
+        }
+        return find_in_levels(p, 1);
+    }
+
+    [[nodiscard]] size_t trained_cells() const {
+        return distributions_.size();
+    }
+
+ private:
+    float cell_size_;
+    float guide_fraction_;
+    std::mutex merge_mutex_;
+    std::unordered_map<uint64_t, guide_statistics> statistics_;
+    std::unordered_map<uint64_t, guide_distribution> distributions_;
+
+    // ячейка мелкого уровня и самое мелкое распределение для нее. find
+    // вызывается на каждом отскоке, поэтому это таблица с открытой
+    // адресацией, а не unordered_map
+    struct finest_cell {
+        uint64_t key = 0;
+        const guide_distribution *distribution = nullptr;
+        bool used = false;
+    };
+    std::vector<finest_cell> finest_;
+    int finest_shift_ = 63;
+
+    // ключи уже перемешаны умножениями в cell_key, слот - их старшие биты
+    [[nodiscard]] size_t finest_slot(uint64_t key) const {
+        return static_cast<size_t>(key >> finest_shift_);
+    }
+
+    // дописывает записи, пока в ячейке меньше max_cell_records
+    static void append_records(std::vector<guide_record> &total,
+                               const std::vector<guide_record> &records) {
+        const auto room =
+            max_cell_records - std::min(max_cell_records, total.size());
+        total.insert(total.end(),
+                     records.begin(),
+                     records.begin() + static_cast<std::ptrdiff_t>(
+                                           std::min(room, records.size())));
+    }
+
+    // самое мелкое распределение для p, начиная с уровня first_level
+    [[nodiscard]] const guide_distribution *
+    find_in_levels(const point3 &p, int first_level) const {
+        for (int level = first_level; level < levels; ++level) {
+            const auto it =
+                distributions_.find(guiding::cell_key(p, cell_size_, level));
+            if (it != distributions_.end()) {
+                return &it->second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// то, что нужно камере для направленного семплирования: обученное
+// распределение и, во время обучения, запись путей потока
+struct path_guiding {
+    const path_guide *guide = nullptr;
+    path_guide::recorder *recorder = nullptr;
+};
+
+#endif
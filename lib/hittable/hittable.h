@@ -3,6 +3,7 @@
 
 #include "interval.h"
 #include "ray.h"
+#include <cstdint>
 
 class material;
 
@@ -14,6 +15,21 @@ class hit_record {
     shared_ptr<material> mat;
     bool front_face;
 
+    float u = 0;  // координаты текстуры в точке пересечения
+    float v = 0;
+    // на сколько меняются (u, v) при сдвиге на единицу длины по
+    // поверхности. Ноль, если у объекта нет координат текстуры
+    float uv_scale = 0;
+    // размер области поверхности, покрываемой лучом, в единицах (u, v).
+    // Заполняется камерой перед вызовом scatter, по нему текстуры выбирают
+    // mip-уровень
+    float uv_footprint = 0;
+
+    // идентификатор объекта, в который попал луч. Должен быть одинаковым у
+    // одного и того же объекта в разных рендерах, по нему инкрементальный
+    // рендер находит тайлы, затронутые правкой сцены
+    uint64_t object_id = 0;
+
     void set_face_normal(const ray &r, const vec3 &outward_normal) {
         // Sets the hit record normal vector.
         // NOTE: the parameter `outward_normal` is assumed to have unit length.
@@ -5,6 +5,8 @@
 #include "hittable.h"
 #include "portal.h"
 #include "ray.h"
+#include "sampler.h"
+#include "texture.h"
 
 class material {
  public:
@@ -12,20 +14,45 @@ class material {
 
     virtual bool scatter(const ray &r_in,
                          const hit_record &rec,
+                         sampler &s,
                          color &attenuation,
                          ray &scattered) const = 0;
+
+    // есть ли у материала плотность распределения отскоков. У зеркала,
+    // стекла и портала направление отскока определено (почти) однозначно,
+    // и направленное семплирование к ним не применяется
+    [[nodiscard]] virtual bool has_density() const {
+        return false;
+    }
+
+    // для материалов с плотностью: в f_cos записывается BSDF, умноженная на
+    // косинус угла с нормалью, для нормированного направления выхода, а в
+    // pdf - плотность, с которой scatter выбирает это направление
+    virtual void evaluate(const ray &,
+                          const hit_record &,
+                          const vec3 &,
+                          color &f_cos,
+                          float &pdf) const {
+        f_cos = color(0, 0, 0);
+        pdf = 0;
+    }
 };
 
 class lambertian : public material {
  public:
-    explicit lambertian(const color &a) : albedo(a) {
+    explicit lambertian(const color &a) : albedo(make_shared<solid_color>(a)) {
+    }
+
+    explicit lambertian(shared_ptr<texture> a) : albedo(std::move(a)) {
     }
 
     bool scatter(const ray &r_in,
                  const hit_record &rec,
+                 sampler &s,
                  color &attenuation,
                  ray &scattered) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        const auto u = s.get_2d();
+        auto scatter_direction = rec.normal + sample_unit_vector(u.x, u.y);
 
         // Отлавливает случай когда нормаль к поверхности и случайное
         // направление диффузного отражения коллапсируют к вектору по норме
@@ -37,31 +64,59 @@ class lambertian : public material {
         }
 
         scattered = ray(rec.p, scatter_direction);
-        attenuation = albedo;
+        attenuation = albedo->value(rec.u, rec.v, rec.uv_footprint);
+        return true;
+    }
+
+    [[nodiscard]] bool has_density() const override {
         return true;
     }
 
+    // scatter выбирает направления с плотностью cos / pi, поэтому
+    // ослабление в нем равно альбедо
+    void evaluate(const ray &,
+                  const hit_record &rec,
+                  const vec3 &direction,
+                  color &f_cos,
+                  float &pdf) const override {
+        const auto cos_theta = dot(direction, rec.normal);
+        if (cos_theta <= 0) {
+            f_cos = color(0, 0, 0);
+            pdf = 0;
+            return;
+        }
+        pdf = cos_theta / static_cast<float>(pi);
+        f_cos = albedo->value(rec.u, rec.v, rec.uv_footprint) * pdf;
+    }
+
  private:
-    color albedo;
+    shared_ptr<texture> albedo;
 };
 
 class metal : public material {
  public:
-    metal(const color &a, float f) : albedo(a), fuzz(f < 1 ? f : 1) {
+    metal(const color &a, float f)
+        : albedo(make_shared<solid_color>(a)), fuzz(f < 1 ? f : 1) {
+    }
+
+    metal(shared_ptr<texture> a, float f)
+        : albedo(std::move(a)), fuzz(f < 1 ? f : 1) {
     }
 
     bool scatter(const ray &r_in,
                  const hit_record &rec,
+                 sampler &s,
                  color &attenuation,
                  ray &scattered) const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_unit_vector());
-        attenuation = albedo;
+        const auto u = s.get_2d();
+        scattered = ray(rec.p, reflected + fuzz * sample_unit_vector(u.x, u.y));
+        attenuation = albedo->value(rec.u, rec.v, rec.uv_footprint);
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
  private:
-    color albedo;
+    shared_ptr<texture> albedo;
     float fuzz;
 };
 
@@ -72,6 +127,7 @@ class portal_fluid : public material {
 
     bool scatter(const ray &r_in,
                  const hit_record &rec,
+                 sampler &,
                  color &attenuation,
                  ray &scattered) const override {
         const auto diff = other_->get_normal() - rec.normal;
@@ -97,6 +153,7 @@ class dielectric : public material {
 
     bool scatter(const ray &r_in,
                  const hit_record &rec,
+                 sampler &s,
                  color &attenuation,
                  ray &scattered) const override {
         attenuation = color(1.0, 1.0, 1.0);
@@ -114,7 +171,7 @@ class dielectric : public material {
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
         if (cannot_refract ||
-            reflectance(cos_theta, refraction_ratio) > random_float()) {
+            reflectance(cos_theta, refraction_ratio) > s.get_1d()) {
             direction = reflect(unit_direction, rec.normal);
         } else {
             direction = refract(unit_direction, rec.normal, refraction_ratio);
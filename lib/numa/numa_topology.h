@@ -0,0 +1,191 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Узел NUMA: набор ядер с общей локальной памятью
+struct numa_node {
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+// Куда поставлен рабочий поток: узел и ядро
+struct worker_placement {
+    int node = 0;
+    int cpu = 0;
+};
+
+// Разбирает список ядер в формате ядра Linux ("0-3,8,10-11")
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        const auto dash = range.find('-');
+        try {
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos
+                                 ? first
+                                 : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception &) {
+            // некорректный фрагмент пропускается
+        }
+    }
+    return cpus;
+}
+
+// Топология NUMA машины. Может быть определена по sysfs или задана вручную
+// (simulated), чтобы проверять распределение потоков по узлам на машине с
+// одним сокетом
+class numa_topology {
+ public:
+    numa_topology() = default;
+
+    explicit numa_topology(std::vector<numa_node> nodes, bool simulated = false)
+        : nodes_(std::move(nodes)), simulated_(simulated) {
+    }
+
+    // читает /sys/devices/system/node. Если информации нет (не Linux или
+    // ядро без NUMA), возвращает один узел со всеми ядрами
+    static numa_topology detect() {
+        std::vector<numa_node> nodes;
+#ifdef __linux__
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        const fs::path root("/sys/devices/system/node");
+        for (const auto &entry : fs::directory_iterator(root, ec)) {
+            const auto name = entry.path().filename().string();
+            const auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+            if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+                !std::all_of(name.begin() + 4, name.end(), is_digit)) {
+                continue;
+            }
+            std::ifstream in(entry.path() / "cpulist");
+            std::string list;
+            std::getline(in, list);
+            auto cpus = parse_cpu_list(list);
+            if (!cpus.empty()) {
+                nodes.push_back({std::stoi(name.substr(4)), std::move(cpus)});
+            }
+        }
+        std::sort(nodes.begin(),
+                  nodes.end(),
+                  [](const numa_node &a, const numa_node &b) {
+                      return a.id < b.id;
+                  });
+#endif
+        if (nodes.empty()) {
+            numa_node node;
+            const auto cpus = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned cpu = 0; cpu < cpus; ++cpu) {
+                node.cpus.push_back(static_cast<int>(cpu));
+            }
+            nodes.push_back(std::move(node));
+        }
+        return numa_topology(std::move(nodes));
+    }
+
+    // node_count узлов по cpus_per_node ядер. Номера ядер берутся по кругу
+    // из реально доступных, поэтому закрепление потоков работает на любой
+    // машине, а распределение по узлам такое же, как на настоящей
+    static numa_topology simulated(int node_count, int cpus_per_node) {
+        const auto hardware = static_cast<int>(
+            std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<numa_node> nodes;
+        int next = 0;
+        for (int n = 0; n < node_count; ++n) {
+            numa_node node;
+            node.id = n;
+            for (int c = 0; c < cpus_per_node; ++c) {
+                node.cpus.push_back(next++ % hardware);
+            }
+            nodes.push_back(std::move(node));
+        }
+        return numa_topology(std::move(nodes), true);
+    }
+
+    [[nodiscard]] const std::vector<numa_node> &nodes() const {
+        return nodes_;
+    }
+
+    [[nodiscard]] int node_count() const {
+        return static_cast<int>(nodes_.size());
+    }
+
+    [[nodiscard]] int cpu_count() const {
+        int count = 0;
+        for (const auto &node : nodes_) {
+            count += static_cast<int>(node.cpus.size());
+        }
+        return count;
+    }
+
+    [[nodiscard]] bool is_simulated() const {
+        return simulated_;
+    }
+
+    // Место k-го рабочего потока. Потоки раздаются узлам по очереди, чтобы
+    // при числе потоков меньше числа ядер нагрузка на узлы была равной.
+    // Внутри узла ядра занимаются по порядку
+    [[nodiscard]] worker_placement place_worker(int k) const {
+        if (nodes_.empty()) {
+            return {};
+        }
+        const auto &node = nodes_[k % nodes_.size()];
+        const auto round = k / static_cast<int>(nodes_.size());
+        if (node.cpus.empty()) {
+            return {node.id, 0};
+        }
+        return {node.id, node.cpus[round % node.cpus.size()]};
+    }
+
+    // индекс узла с данным id в nodes()
+    [[nodiscard]] int node_index(int id) const {
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            if (nodes_[i].id == id) {
+                return static_cast<int>(i);
+            }
+        }
+        return 0;
+    }
+
+ private:
+    std::vector<numa_node> nodes_;
+    bool simulated_ = false;
+};
+
+// Закрепляет текущий поток за ядром cpu. Возвращает false, если платформа
+// не поддерживает закрепление или ядро недоступно
+inline bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
@@ -40,6 +40,7 @@ class square_portal : public hittable {
 
         rec.t = t_intersection;
         rec.mat = fluid_;
+        rec.object_id = object_id();
         rec.set_face_normal(r, n_);  // поставит флаг
 
         const auto q_coord = dot(q_proj, q_) > 0
@@ -57,6 +58,10 @@ class square_portal : public hittable {
         return true;
     }
 
+    [[nodiscard]] uint64_t object_id() const {
+        return reinterpret_cast<uintptr_t>(this);
+    }
+
     [[nodiscard]] vec3 get_normal() const {
         return n_;
     }
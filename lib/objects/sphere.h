@@ -3,6 +3,8 @@
 
 #include "hittable.h"
 #include "vec3.h"
+#include <algorithm>
+#include <cmath>
 
 class sphere : public hittable {
  public:
@@ -11,6 +13,25 @@ class sphere : public hittable {
     }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+        if (!intersect(center, radius, r, ray_t, rec)) {
+            return false;
+        }
+        rec.mat = mat;
+        rec.object_id = object_id();
+        return true;
+    }
+
+    [[nodiscard]] uint64_t object_id() const {
+        return reinterpret_cast<uintptr_t>(this);
+    }
+
+    // Пересечение луча со сферой без материала. Заполняет в rec все, кроме
+    // mat и object_id. Используется и объектами, которые хранят сферы не как sphere
+    static bool intersect(const point3 &center,
+                          float radius,
+                          const ray &r,
+                          interval ray_t,
+                          hit_record &rec) {
         vec3 oc = r.origin() - center;
         auto a = r.direction().length_squared();
         auto half_b = dot(oc, r.direction());
@@ -34,7 +55,9 @@ class sphere : public hittable {
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
-        rec.mat = mat;
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        // длина меридиана - pi * radius, а v меняется на нем от 0 до 1
+        rec.uv_scale = 1 / (static_cast<float>(pi) * radius);
 
         return true;
     }
@@ -43,6 +66,16 @@ class sphere : public hittable {
     point3 center;
     float radius;
     shared_ptr<material> mat;
+
+    // p - точка на единичной сфере с центром в начале координат.
+    // u - угол вокруг оси Y от X=-1, v - угол от Y=-1 до Y=+1, оба
+    // нормированы к [0, 1]
+    static void get_sphere_uv(const point3 &p, float &u, float &v) {
+        const auto theta = std::acos(std::clamp(-p.y(), -1.0f, 1.0f));
+        const auto phi = std::atan2(-p.z(), p.x()) + static_cast<float>(pi);
+        u = phi / (2 * static_cast<float>(pi));
+        v = theta / static_cast<float>(pi);
+    }
 };
 
 #endif
@@ -0,0 +1,777 @@
+#ifndef PAGED_BVH_H
+#define PAGED_BVH_H
+
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+#include "vec3.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Формат файла сцены, которая не помещается в память.
+//
+//   paged_bvh_header
+//   верхние узлы BVH (paged_bvh_node) - всегда загружены в память
+//   страницы, выровненные по page_size. Каждая страница - поддерево BVH:
+//     paged_bvh_page_header, узлы поддерева, сферы поддерева
+//
+// Верхний узел либо внутренний (count < 0, левый потомок следует сразу за
+// ним, правый - в first), либо ссылается на страницу с номером count. Узел
+// страницы либо внутренний (count == 0, правый потомок в first), либо лист
+// со сферами [first, first + count). Все индексы внутри страницы локальные,
+// поэтому страница читается без обращения к остальному файлу
+// 128-битный хэш содержимого сцены: две половины считаются независимо,
+// поэтому случайное совпадение ключей разных сцен практически исключено
+struct paged_bvh_hash {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const paged_bvh_hash &) const = default;
+};
+
+struct paged_bvh_header {
+    char magic[4] = {'R', 'T', 'P', 'B'};
+    uint32_t version = 4;
+    uint32_t page_size = 0;
+    uint32_t page_count = 0;
+    uint32_t top_node_count = 0;
+    uint32_t material_count = 0;
+    uint64_t primitive_count = 0;
+    uint64_t top_nodes_offset = 0;
+    uint64_t pages_offset = 0;
+    paged_bvh_hash scene_hash;  // paged_bvh_builder::content_hash
+};
+
+struct paged_bvh_node {
+    float min[3];
+    float max[3];
+    int32_t first;  // правый потомок или первая сфера листа
+    int32_t count;  // для верхних узлов - номер страницы или -1
+};
+
+struct paged_bvh_page_header {
+    uint32_t node_count;
+    uint32_t primitive_count;
+};
+
+struct paged_sphere {
+    float center[3];
+    float radius;
+    uint32_t material;  // индекс в таблице материалов сцены
+    uint32_t id;  // порядковый номер сферы при добавлении в builder
+};
+
+struct paged_bvh_stats {
+    uint64_t page_loads = 0;  // обращений к неразмещенным страницам
+    uint64_t evictions = 0;
+    uint32_t resident_pages = 0;
+    uint32_t peak_resident_pages = 0;
+    uint32_t budget_pages = 0;
+    uint32_t page_count = 0;
+};
+
+namespace paging {
+
+struct aabb {
+    float min[3] = {infinity, infinity, infinity};
+    float max[3] = {-infinity, -infinity, -infinity};
+
+    void expand(const float center[3], float radius) {
+        for (int a = 0; a < 3; ++a) {
+            min[a] = std::min(min[a], center[a] - radius);
+            max[a] = std::max(max[a], center[a] + radius);
+        }
+    }
+};
+
+// пересекает ли луч коробку на отрезке ray_t (метод плит)
+inline bool hit_box(const paged_bvh_node &node,
+                    const point3 &origin,
+                    const vec3 &inv_dir,
+                    interval ray_t) {
+    for (int a = 0; a < 3; ++a) {
+        auto t0 = (node.min[a] - origin[a]) * inv_dir[a];
+        auto t1 = (node.max[a] - origin[a]) * inv_dir[a];
+        if (inv_dir[a] < 0) {
+            std::swap(t0, t1);
+        }
+        ray_t.min = std::max(t0, ray_t.min);
+        ray_t.max = std::min(t1, ray_t.max);
+        if (ray_t.max < ray_t.min) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// глубина обхода дерева, при которой он помещается в стек из 64 элементов
+inline constexpr int max_tree_depth = 62;
+
+// проверяет дерево из count узлов, записанное так, как его пишет builder:
+// у внутреннего узла левый потомок следует сразу за ним, правый лежит
+// дальше в пределах массива. Поэтому обход не зацикливается и не выходит
+// за массив, а глубина ограничена max_tree_depth. is_leaf отличает листья,
+// leaf_valid проверяет, на что лист ссылается
+template <class IsLeaf, class LeafValid>
+bool valid_tree(const paged_bvh_node *nodes,
+                uint32_t count,
+                const IsLeaf &is_leaf,
+                const LeafValid &leaf_valid) {
+    if (count == 0) {
+        return false;
+    }
+    std::vector<uint8_t> depth(count, 0);
+    for (uint32_t i = 0; i < count; ++i) {
+        const auto &node = nodes[i];
+        if (is_leaf(node)) {
+            if (!leaf_valid(node)) {
+                return false;
+            }
+            continue;
+        }
+        if (depth[i] >= max_tree_depth || i + 1 >= count ||
+            node.first <= int64_t(i) + 1 || uint32_t(node.first) >= count) {
+            return false;
+        }
+        const auto child = static_cast<uint8_t>(depth[i] + 1);
+        depth[i + 1] = std::max(depth[i + 1], child);
+        depth[node.first] = std::max(depth[node.first], child);
+    }
+    return true;
+}
+
+}  // namespace paging
+
+// Собирает сферы, строит BVH и записывает его в файл формата paged_bvh.
+// Построение требует всех сфер в памяти, поэтому делается заранее на
+// машине, где они помещаются
+class paged_bvh_builder {
+ public:
+    void add(const point3 &center, float radius, uint32_t material) {
+        primitives_.push_back({{center.x(), center.y(), center.z()},
+                               radius,
+                               material,
+                               static_cast<uint32_t>(primitives_.size())});
+        material_count_ = std::max(material_count_, material + 1);
+    }
+
+    [[nodiscard]] size_t size() const {
+        return primitives_.size();
+    }
+
+    [[nodiscard]] const std::vector<paged_sphere> &primitives() const {
+        return primitives_;
+    }
+
+    // хэш содержимого сцены: сфер в порядке добавления, числа материалов,
+    // размера страницы и версии формата. Одинаковые сцены дают одинаковый
+    // файл, поэтому хэш служит ключом кэша построенных BVH. Данные читаются
+    // 8-байтными словами, а не по байтам, чтобы хэш миллиона сфер занимал
+    // миллисекунды. Младшая половина - FNV-1a по словам, старшая - другое
+    // умножение с другим начальным значением, и обе в конце перемешиваются
+    [[nodiscard]] paged_bvh_hash content_hash(
+        uint32_t page_size = 16384) const {
+        uint64_t a = 0xcbf29ce484222325ull;
+        uint64_t b = 0x6a09e667f3bcc909ull;
+        const auto mix_word = [&a, &b](uint64_t word) {
+            a = (a ^ word) * 0x100000001b3ull;
+            a ^= a >> 32;
+            b = (b + word) * 0x9e3779b97f4a7c15ull;
+            b ^= b >> 29;
+        };
+        const auto mix = [&mix_word](const void *data, size_t size) {
+            const auto *bytes = static_cast<const unsigned char *>(data);
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                uint64_t word;
+                std::memcpy(&word, bytes + i, 8);
+                mix_word(word);
+            }
+            if (i < size) {
+                uint64_t word = 0;
+                std::memcpy(&word, bytes + i, size - i);
+                mix_word(word);
+            }
+            mix_word(size);
+        };
+        const auto finish = [](uint64_t h) {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            return h ^ (h >> 33);
+        };
+        const auto version = paged_bvh_header{}.version;
+        mix(&version, sizeof(version));
+        mix(&page_size, sizeof(page_size));
+        mix(&material_count_, sizeof(material_count_));
+        mix(primitives_.data(), primitives_.size() * sizeof(paged_sphere));
+        return {finish(a), finish(b)};
+    }
+
+    // page_size должен быть кратен размеру страницы памяти системы
+    bool write(const std::string &path, uint32_t page_size = 16384) {
+        const int fd =
+            ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        const bool written = write(fd, page_size);
+        return ::close(fd) == 0 && written;
+    }
+
+    // записывает файл сцены в открытый на запись файл fd с его начала
+    bool write(int fd, uint32_t page_size = 16384) {
+        if (primitives_.empty() || page_size % 4096 != 0) {
+            return false;
+        }
+        // хэш считается до построения, которое переставляет сферы
+        const auto scene_hash = content_hash(page_size);
+        page_size_ = page_size;
+        nodes_.clear();
+        top_nodes_.clear();
+        pages_.clear();
+        build(0, static_cast<uint32_t>(primitives_.size()));
+        emit_top(0);
+
+        paged_bvh_header header;
+        header.page_size = page_size_;
+        header.page_count = static_cast<uint32_t>(pages_.size());
+        header.top_node_count = static_cast<uint32_t>(top_nodes_.size());
+        header.material_count = material_count_;
+        header.primitive_count = primitives_.size();
+        header.top_nodes_offset = sizeof(header);
+        const auto top_end = header.top_nodes_offset +
+                             top_nodes_.size() * sizeof(paged_bvh_node);
+        header.pages_offset =
+            (top_end + page_size_ - 1) / page_size_ * page_size_;
+        header.scene_hash = scene_hash;
+
+        const std::vector<char> padding(header.pages_offset - top_end, 0);
+        bool ok = write_raw(fd, &header, sizeof(header)) &&
+                  write_raw(fd,
+                            top_nodes_.data(),
+                            top_nodes_.size() * sizeof(paged_bvh_node)) &&
+                  write_raw(fd, padding.data(), padding.size());
+        for (const auto &page : pages_) {
+            ok = ok && write_raw(fd, page.data(), page.size());
+        }
+        return ok;
+    }
+
+ private:
+    // узел BVH во время построения
+    struct build_node {
+        paging::aabb box;
+        uint32_t first = 0;  // сферы [first, first + count)
+        uint32_t count = 0;
+        int32_t left = -1;
+        int32_t right = -1;
+    };
+
+    static constexpr uint32_t max_leaf_size = 4;
+
+    std::vector<paged_sphere> primitives_;
+    uint32_t material_count_ = 0;
+    uint32_t page_size_ = 0;
+    std::vector<build_node> nodes_;
+    std::vector<paged_bvh_node> top_nodes_;
+    std::vector<std::vector<char>> pages_;
+
+    // write может записать не все сразу, поэтому пишется в цикле
+    static bool write_raw(int fd, const void *data, size_t size) {
+        const auto *bytes = static_cast<const char *>(data);
+        while (size > 0) {
+            const auto written = ::write(fd, bytes, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            bytes += written;
+            size -= size_t(written);
+        }
+        return true;
+    }
+
+    static float centroid(const paged_sphere &s, int axis) {
+        return s.center[axis];
+    }
+
+    // строит поддерево над сферами [first, first + count) делением по
+    // медиане центров вдоль самой длинной оси. Возвращает индекс узла
+    int32_t build(uint32_t first, uint32_t count) {
+        const auto index = static_cast<int32_t>(nodes_.size());
+        nodes_.emplace_back();
+        paging::aabb box;
+        paging::aabb centers;
+        for (uint32_t i = first; i < first + count; ++i) {
+            box.expand(primitives_[i].center, primitives_[i].radius);
+            centers.expand(primitives_[i].center, 0);
+        }
+        nodes_[index].box = box;
+        nodes_[index].first = first;
+        nodes_[index].count = count;
+        if (count <= max_leaf_size) {
+            return index;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) {
+            if (centers.max[a] - centers.min[a] >
+                centers.max[axis] - centers.min[axis]) {
+                axis = a;
+            }
+        }
+        const auto begin = primitives_.begin() + first;
+        const auto mid = begin + count / 2;
+        std::nth_element(begin,
+                         mid,
+                         begin + count,
+                         [axis](const paged_sphere &a, const paged_sphere &b) {
+                             return centroid(a, axis) < centroid(b, axis);
+                         });
+
+        const auto left = build(first, count / 2);
+        const auto right = build(first + count / 2, count - count / 2);
+        nodes_[index].left = left;
+        nodes_[index].right = right;
+        return index;
+    }
+
+    [[nodiscard]] uint32_t subtree_nodes(int32_t node) const {
+        const auto &n = nodes_[node];
+        if (n.left < 0) {
+            return 1;
+        }
+        return 1 + subtree_nodes(n.left) + subtree_nodes(n.right);
+    }
+
+    [[nodiscard]] bool fits_in_page(int32_t node) const {
+        const auto bytes = sizeof(paged_bvh_page_header) +
+                           size_t(subtree_nodes(node)) * sizeof(paged_bvh_node) +
+                           size_t(nodes_[node].count) * sizeof(paged_sphere);
+        return bytes <= page_size_;
+    }
+
+    static paged_bvh_node make_node(const paging::aabb &box,
+                                    int32_t first,
+                                    int32_t count) {
+        paged_bvh_node node{};
+        std::copy(box.min, box.min + 3, node.min);
+        std::copy(box.max, box.max + 3, node.max);
+        node.first = first;
+        node.count = count;
+        return node;
+    }
+
+    // верхние уровни: поддеревья, помещающиеся в страницу, становятся
+    // страницами, остальные узлы остаются в памяти
+    void emit_top(int32_t node) {
+        const auto index = top_nodes_.size();
+        if (fits_in_page(node)) {
+            top_nodes_.push_back(make_node(
+                nodes_[node].box, 0, static_cast<int32_t>(pages_.size())));
+            emit_page(node);
+            return;
+        }
+        top_nodes_.push_back(make_node(nodes_[node].box, 0, -1));
+        emit_top(nodes_[node].left);
+        top_nodes_[index].first = static_cast<int32_t>(top_nodes_.size());
+        emit_top(nodes_[node].right);
+    }
+
+    void emit_page(int32_t root) {
+        std::vector<paged_bvh_node> nodes;
+        std::vector<paged_sphere> spheres;
+        emit_page_node(root, nodes, spheres);
+
+        std::vector<char> page(page_size_, 0);
+        const paged_bvh_page_header header{static_cast<uint32_t>(nodes.size()),
+                                           static_cast<uint32_t>(spheres.size())};
+        auto *out = page.data();
+        std::memcpy(out, &header, sizeof(header));
+        out += sizeof(header);
+        std::memcpy(out, nodes.data(), nodes.size() * sizeof(paged_bvh_node));
+        out += nodes.size() * sizeof(paged_bvh_node);
+        std::memcpy(out, spheres.data(), spheres.size() * sizeof(paged_sphere));
+        pages_.push_back(std::move(page));
+    }
+
+    void emit_page_node(int32_t node,
+                        std::vector<paged_bvh_node> &nodes,
+                        std::vector<paged_sphere> &spheres) {
+        const auto &n = nodes_[node];
+        const auto index = nodes.size();
+        if (n.left < 0) {
+            nodes.push_back(make_node(n.box,
+                                      static_cast<int32_t>(spheres.size()),
+                                      static_cast<int32_t>(n.count)));
+            spheres.insert(spheres.end(),
+                           primitives_.begin() + n.first,
+                           primitives_.begin() + n.first + n.count);
+            return;
+        }
+        nodes.push_back(make_node(n.box, 0, 0));
+        emit_page_node(n.left, nodes, spheres);
+        nodes[index].first = static_cast<int32_t>(nodes.size());
+        emit_page_node(n.right, nodes, spheres);
+    }
+};
+
+// Сцена из файла paged_bvh. Файл отображается в память через mmap, верхние
+// узлы копируются и всегда остаются в памяти, а страницы подгружаются
+// операционной системой при первом обращении.
+//
+// Число размещенных страниц ограничено budget_bytes: при превышении
+// страницы вытесняются алгоритмом часов через madvise(MADV_DONTNEED).
+// Отображение файловое и только для чтения, поэтому поток, который еще
+// читает вытесненную страницу, просто получит ее заново с диска
+class paged_bvh : public hittable {
+ public:
+    paged_bvh(const std::string &path,
+              std::vector<shared_ptr<material>> materials,
+              size_t budget_bytes)
+        : materials_(std::move(materials)), path_(path) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        struct stat st {};
+        if (fd_ < 0 || ::fstat(fd_, &st) != 0 ||
+            size_t(st.st_size) < sizeof(paged_bvh_header)) {
+            fail(path);
+            return;
+        }
+        size_ = size_t(st.st_size);
+        auto *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (data == MAP_FAILED) {
+            fail(path);
+            return;
+        }
+        data_ = static_cast<const char *>(data);
+        std::memcpy(&header_, data_, sizeof(header_));
+        if (!valid_header()) {
+            fail(path);
+            return;
+        }
+        const auto *top = reinterpret_cast<const paged_bvh_node *>(
+            data_ + header_.top_nodes_offset);
+        const auto page_count = header_.page_count;
+        if (!paging::valid_tree(
+                top,
+                header_.top_node_count,
+                [](const paged_bvh_node &node) { return node.count >= 0; },
+                [page_count](const paged_bvh_node &node) {
+                    return uint32_t(node.count) < page_count;
+                })) {
+            fail(path);
+            return;
+        }
+        top_nodes_.assign(top, top + header_.top_node_count);
+        // верхние узлы скопированы, их страницы файла больше не нужны
+        ::madvise(const_cast<char *>(data_),
+                  header_.pages_offset,
+                  MADV_DONTNEED);
+        // доступ к страницам сцены случайный, упреждающее чтение вредно
+        ::madvise(const_cast<char *>(data_) + header_.pages_offset,
+                  uint64_t(header_.page_count) * header_.page_size,
+                  MADV_RANDOM);
+
+        budget_pages_ = static_cast<uint32_t>(
+            std::max<size_t>(1, budget_bytes / header_.page_size));
+        page_state_ =
+            std::make_unique<std::atomic<uint8_t>[]>(header_.page_count);
+        page_check_ =
+            std::make_unique<std::atomic<uint8_t>[]>(header_.page_count);
+    }
+
+    paged_bvh(const paged_bvh &) = delete;
+    paged_bvh &operator=(const paged_bvh &) = delete;
+
+    ~paged_bvh() override {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // false, если файл не загрузился или при рендере нашлась испорченная
+    // страница
+    [[nodiscard]] bool is_open() const {
+        return !top_nodes_.empty() && !corrupt_.load(std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] uint64_t primitive_count() const {
+        return header_.primitive_count;
+    }
+
+    [[nodiscard]] paged_bvh_hash scene_hash() const {
+        return header_.scene_hash;
+    }
+
+    // идентификатор сферы с номером id в порядке добавления в builder. Он
+    // не меняется при перестроении BVH, поэтому подходит для scene_edit
+    [[nodiscard]] static uint64_t object_id(uint32_t id) {
+        return (uint64_t(1) << 63) | id;
+    }
+
+    [[nodiscard]] paged_bvh_stats stats() const {
+        return {page_loads_.load(std::memory_order_relaxed),
+                evictions_.load(std::memory_order_relaxed),
+                resident_pages_.load(std::memory_order_relaxed),
+                peak_resident_pages_.load(std::memory_order_relaxed),
+                budget_pages_,
+                header_.page_count};
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+        if (!is_open()) {
+            return false;
+        }
+        const auto dir = r.direction();
+        const vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+        const auto origin = r.origin();
+
+        bool hit_anything = false;
+        int32_t stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0) {
+            const auto &node = top_nodes_[stack[--depth]];
+            if (!paging::hit_box(node, origin, inv_dir, ray_t)) {
+                continue;
+            }
+            if (node.count >= 0) {
+                if (hit_page(node.count, r, inv_dir, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+                continue;
+            }
+            const auto index = static_cast<int32_t>(&node - top_nodes_.data());
+            stack[depth++] = node.first;
+            stack[depth++] = index + 1;
+        }
+        return hit_anything;
+    }
+
+ private:
+    enum page_state : uint8_t { absent, resident, referenced };
+    enum page_check : uint8_t { unchecked, valid, invalid };
+
+    std::vector<shared_ptr<material>> materials_;
+    int fd_ = -1;
+    size_t size_ = 0;
+    const char *data_ = nullptr;
+    paged_bvh_header header_;
+    std::vector<paged_bvh_node> top_nodes_;
+
+    uint32_t budget_pages_ = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> page_state_;
+    std::unique_ptr<std::atomic<uint8_t>[]> page_check_;
+    mutable std::atomic<bool> corrupt_ = false;
+    std::string path_;
+    mutable std::atomic<uint32_t> resident_pages_ = 0;
+    mutable std::atomic<uint32_t> peak_resident_pages_ = 0;
+    mutable std::atomic<uint64_t> page_loads_ = 0;
+    mutable std::atomic<uint64_t> evictions_ = 0;
+    mutable std::mutex evict_mutex_;
+    mutable uint32_t clock_hand_ = 0;  // защищен evict_mutex_
+
+    // заголовок не выходит за файл, и все области файла выровнены так, что
+    // узлы и сферы можно читать прямо из отображения
+    [[nodiscard]] bool valid_header() const {
+        const auto &h = header_;
+        const auto top_end = h.top_nodes_offset + uint64_t(h.top_node_count) *
+                                                      sizeof(paged_bvh_node);
+        return std::memcmp(h.magic, "RTPB", 4) == 0 &&
+               h.version == paged_bvh_header{}.version &&
+               h.material_count <= materials_.size() &&
+               h.page_size >= sizeof(paged_bvh_page_header) &&
+               h.page_size % alignof(paged_bvh_node) == 0 &&
+               h.top_nodes_offset >= sizeof(paged_bvh_header) &&
+               h.top_nodes_offset % alignof(paged_bvh_node) == 0 &&
+               h.top_nodes_offset <= size_ && top_end <= h.pages_offset &&
+               h.pages_offset % alignof(paged_bvh_node) == 0 &&
+               h.pages_offset <= size_ &&
+               uint64_t(h.page_count) * h.page_size <= size_ - h.pages_offset;
+    }
+
+    // проверяет страницу при первом обращении: узлы и сферы помещаются в
+    // страницу, индексы узлов и сфер не выходят за нее, материалы есть в
+    // таблице. Испорченная страница не читается, а сцена перестает
+    // возвращать пересечения. Выгрузить файл здесь нельзя: его могут
+    // читать другие потоки
+    bool check_page(uint32_t page_index, const char *page) const {
+        auto &check = page_check_[page_index];
+        const auto known = check.load(std::memory_order_acquire);
+        if (known != unchecked) {
+            return known == valid;
+        }
+        paged_bvh_page_header header;
+        std::memcpy(&header, page, sizeof(header));
+        const auto bytes =
+            sizeof(paged_bvh_page_header) +
+            uint64_t(header.node_count) * sizeof(paged_bvh_node) +
+            uint64_t(header.primitive_count) * sizeof(paged_sphere);
+        bool ok = bytes <= header_.page_size;
+        if (ok) {
+            const auto *nodes = reinterpret_cast<const paged_bvh_node *>(
+                page + sizeof(paged_bvh_page_header));
+            const auto *spheres = reinterpret_cast<const paged_sphere *>(
+                nodes + header.node_count);
+            const auto primitives = header.primitive_count;
+            ok = paging::valid_tree(
+                nodes,
+                header.node_count,
+                [](const paged_bvh_node &node) { return node.count != 0; },
+                [primitives](const paged_bvh_node &node) {
+                    return node.count > 0 && node.first >= 0 &&
+                           int64_t(node.first) + node.count <= primitives;
+                });
+            for (uint32_t i = 0; ok && i < primitives; ++i) {
+                ok = spheres[i].material < header_.material_count;
+            }
+        }
+        check.store(ok ? valid : invalid, std::memory_order_release);
+        if (!ok && !corrupt_.exchange(true)) {
+            std::cerr << "ERROR: Corrupt page " << page_index
+                      << " in paged scene '" << path_ << "'.\n";
+        }
+        return ok;
+    }
+
+    void fail(const std::string &path) {
+        std::cerr << "ERROR: Could not load paged scene '" << path << "'.\n";
+        top_nodes_.clear();
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char *>(data_), size_);
+            data_ = nullptr;
+        }
+    }
+
+    // отмечает обращение к странице и, если страниц в памяти больше
+    // бюджета, вытесняет лишние
+    const char *touch_page(uint32_t page) const {
+        auto &state = page_state_[page];
+        auto current = state.load(std::memory_order_relaxed);
+        while (current != referenced) {
+            if (!state.compare_exchange_weak(current, referenced)) {
+                continue;
+            }
+            if (current == absent) {
+                page_loads_.fetch_add(1, std::memory_order_relaxed);
+                const auto resident =
+                    resident_pages_.fetch_add(1, std::memory_order_relaxed) + 1;
+                auto peak = peak_resident_pages_.load(std::memory_order_relaxed);
+                while (resident > peak &&
+                       !peak_resident_pages_.compare_exchange_weak(peak,
+                                                                   resident)) {
+                }
+                if (resident > budget_pages_) {
+                    evict();
+                }
+            }
+            break;
+        }
+        return data_ + header_.pages_offset +
+               uint64_t(page) * header_.page_size;
+    }
+
+    // алгоритм часов: страницы с флагом обращения получают второй шанс,
+    // остальные отдаются системе. Если вытеснением уже занят другой поток,
+    // текущий не ждет
+    void evict() const {
+        std::unique_lock lock(evict_mutex_, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+        auto &hand = clock_hand_;
+        // два полных оборота гарантированно находят жертву, если она есть
+        for (uint32_t step = 0;
+             step < 2 * header_.page_count &&
+             resident_pages_.load(std::memory_order_relaxed) > budget_pages_;
+             ++step) {
+            auto &state = page_state_[hand];
+            auto current = state.load(std::memory_order_relaxed);
+            if (current == referenced) {
+                state.compare_exchange_strong(current, resident);
+            } else if (current == resident &&
+                       state.compare_exchange_strong(current, absent)) {
+                ::madvise(const_cast<char *>(data_) + header_.pages_offset +
+                              uint64_t(hand) * header_.page_size,
+                          header_.page_size,
+                          MADV_DONTNEED);
+                resident_pages_.fetch_sub(1, std::memory_order_relaxed);
+                evictions_.fetch_add(1, std::memory_order_relaxed);
+            }
+            hand = (hand + 1) % header_.page_count;
+        }
+    }
+
+    bool hit_page(uint32_t page_index,
+                  const ray &r,
+                  const vec3 &inv_dir,
+                  interval ray_t,
+                  hit_record &rec) const {
+        const auto *page = touch_page(page_index);
+        if (!check_page(page_index, page)) {
+            return false;
+        }
+        paged_bvh_page_header header;
+        std::memcpy(&header, page, sizeof(header));
+        const auto *nodes = reinterpret_cast<const paged_bvh_node *>(
+            page + sizeof(paged_bvh_page_header));
+        const auto *spheres =
+            reinterpret_cast<const paged_sphere *>(nodes + header.node_count);
+
+        const auto origin = r.origin();
+        bool hit_anything = false;
+        const paged_sphere *closest = nullptr;
+        int32_t stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0) {
+            const auto index = stack[--depth];
+            const auto &node = nodes[index];
+            if (!paging::hit_box(node, origin, inv_dir, ray_t)) {
+                continue;
+            }
+            if (node.count > 0) {
+                for (int32_t i = node.first; i < node.first + node.count; ++i) {
+                    const auto &s = spheres[i];
+                    const point3 center(s.center[0], s.center[1], s.center[2]);
+                    if (sphere::intersect(center, s.radius, r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                        closest = &s;
+                    }
+                }
+                continue;
+            }
+            stack[depth++] = node.first;
+            stack[depth++] = index + 1;
+        }
+        if (hit_anything) {
+            rec.mat = materials_[closest->material];
+            rec.object_id = object_id(closest->id);
+        }
+        return hit_anything;
+    }
+};
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "material.h"
+#include "paged_bvh.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct scene_cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Кэш построенных BVH на диске. Файл сцены формата paged_bvh хранится в
+// каталоге кэша под именем, полученным из 128-битного хэша содержимого
+// сцены, поэтому повторный запуск с той же сценой не строит BVH заново, а
+// сразу отображает готовый файл в память. Перед использованием файла
+// сверяются полный хэш и число сфер из его заголовка.
+//
+// С пустым каталогом кэш выключен: BVH каждый раз строится во временный
+// файл, и на диске ничего не остается.
+//
+// Материалы в файл не попадают: они передаются при загрузке, и их можно
+// менять без перестроения. Файл записывается во временный и затем
+// переименовывается, так что параллельные запуски и прерванная запись не
+// оставляют в кэше недописанных файлов.
+//
+// paged_bvh доверяет смещениям из файла, поэтому каталог кэша должен
+// принадлежать пользователю и быть закрыт для записи остальным. Каталог
+// создается с правами 0700, а если он чужой или открыт на запись, кэш не
+// используется и BVH строится во временный файл при каждом запуске
+class scene_cache {
+ public:
+    explicit scene_cache(std::filesystem::path directory)
+        : directory_(std::move(directory)) {
+    }
+
+    // каталог кэша пользователя: $XDG_CACHE_HOME/raytracer или
+    // ~/.cache/raytracer. Пустой путь, если домашний каталог неизвестен
+    static std::filesystem::path default_directory() {
+        const char *xdg = std::getenv("XDG_CACHE_HOME");
+        if (xdg != nullptr && xdg[0] == '/') {
+            return std::filesystem::path(xdg) / "raytracer";
+        }
+        const char *home = std::getenv("HOME");
+        if (home == nullptr || home[0] == '\0') {
+            const auto *user = ::getpwuid(::getuid());
+            home = user != nullptr ? user->pw_dir : nullptr;
+        }
+        if (home == nullptr || home[0] == '\0') {
+            return {};
+        }
+        return std::filesystem::path(home) / ".cache" / "raytracer";
+    }
+
+    [[nodiscard]] const std::filesystem::path &directory() const {
+        return directory_;
+    }
+
+    [[nodiscard]] std::filesystem::path path_for(
+        const paged_bvh_hash &scene_hash) const {
+        char name[48];
+        std::snprintf(name,
+                      sizeof(name),
+                      "%016llx%016llx.rtpb",
+                      static_cast<unsigned long long>(scene_hash.high),
+                      static_cast<unsigned long long>(scene_hash.low));
+        return directory_ / name;
+    }
+
+    // возвращает сцену builder'а из кэша, а если ее там нет или файл
+    // устарел - строит BVH, записывает его в кэш и загружает
+    shared_ptr<paged_bvh> load_or_build(
+        paged_bvh_builder &builder,
+        std::vector<shared_ptr<material>> materials,
+        size_t budget_bytes,
+        uint32_t page_size = 16384) {
+        const auto hash = builder.content_hash(page_size);
+        const auto path = path_for(hash);
+        if (prepare_directory()) {
+            if (is_valid(path, hash, builder.primitives().size(), page_size)) {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return make_shared<paged_bvh>(
+                    path.string(), std::move(materials), budget_bytes);
+            }
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            if (store(builder, path, page_size)) {
+                return make_shared<paged_bvh>(
+                    path.string(), std::move(materials), budget_bytes);
+            }
+        } else {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return build_uncached(
+            builder, std::move(materials), budget_bytes, page_size);
+    }
+
+    [[nodiscard]] scene_cache_stats stats() const {
+        return {hits_.load(std::memory_order_relaxed),
+                misses_.load(std::memory_order_relaxed)};
+    }
+
+ private:
+    std::filesystem::path directory_;
+    std::atomic<uint64_t> hits_ = 0;
+    std::atomic<uint64_t> misses_ = 0;
+
+    // создает каталог кэша с правами 0700 и проверяет, что это каталог,
+    // а не ссылка, что он принадлежит текущему пользователю и что другие
+    // не могут в него писать
+    [[nodiscard]] bool prepare_directory() const {
+        if (directory_.empty()) {
+            return false;
+        }
+        std::error_code error;
+        std::filesystem::create_directories(directory_.parent_path(), error);
+        if (::mkdir(directory_.c_str(), 0700) != 0 && errno != EEXIST) {
+            return false;
+        }
+        struct stat st {};
+        if (::lstat(directory_.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != ::geteuid() ||
+            (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+            std::cerr << "ERROR: Scene cache directory '" << directory_.string()
+                      << "' is not private, the cache is disabled.\n";
+            return false;
+        }
+        return true;
+    }
+
+    // файл подходит, если это обычный файл текущего пользователя с текущей
+    // версией формата, нужными хэшем и числом сфер и размером, который
+    // следует из заголовка. Содержимое страниц проверяет сам paged_bvh
+    static bool is_valid(const std::filesystem::path &path,
+                         const paged_bvh_hash &hash,
+                         uint64_t primitive_count,
+                         uint32_t page_size) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st {};
+        paged_bvh_header header;
+        const bool ok =
+            ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_uid == ::geteuid() &&
+            ::pread(fd, &header, sizeof(header), 0) ==
+                ssize_t(sizeof(header)) &&
+            std::memcmp(header.magic, "RTPB", 4) == 0 &&
+            header.version == paged_bvh_header{}.version &&
+            header.scene_hash == hash &&
+            header.primitive_count == primitive_count &&
+            header.page_size == page_size &&
+            header.pages_offset <= uint64_t(st.st_size) &&
+            uint64_t(st.st_size) - header.pages_offset ==
+                uint64_t(header.page_count) * header.page_size;
+        ::close(fd);
+        return ok;
+    }
+
+    // записывает сцену в новый файл path. Файл создается с O_EXCL и
+    // O_NOFOLLOW, поэтому запись не пойдет по подложенной ссылке и не
+    // перезапишет существующий файл
+    static bool write_new(paged_bvh_builder &builder,
+                          const std::filesystem::path &path,
+                          uint32_t page_size) {
+        const int fd =
+            ::open(path.c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                   0600);
+        if (fd < 0) {
+            return false;
+        }
+        const bool written = builder.write(fd, page_size);
+        if (::close(fd) != 0 || !written) {
+            ::unlink(path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool store(paged_bvh_builder &builder,
+                      const std::filesystem::path &path,
+                      uint32_t page_size) {
+        auto temporary = path;
+        temporary += ".tmp" + std::to_string(::getpid());
+        // остаток прерванной записи процесса с тем же pid
+        ::unlink(temporary.c_str());
+        std::error_code error;
+        if (write_new(builder, temporary, page_size)) {
+            std::filesystem::rename(temporary, path, error);
+            if (!error) {
+                return true;
+            }
+            std::filesystem::remove(temporary, error);
+        }
+        std::cerr << "ERROR: Could not write scene cache '" << path.string()
+                  << "'.\n";
+        return false;
+    }
+
+    // строит сцену во временном каталоге, доступном только пользователю, и
+    // сразу удаляет файл: отображение paged_bvh остается действительным
+    static shared_ptr<paged_bvh> build_uncached(
+        paged_bvh_builder &builder,
+        std::vector<shared_ptr<material>> materials,
+        size_t budget_bytes,
+        uint32_t page_size) {
+        std::error_code error;
+        auto pattern = (std::filesystem::temp_directory_path(error) /
+                        "raytracer_scene.XXXXXX")
+                           .string();
+        if (error || ::mkdtemp(pattern.data()) == nullptr) {
+            std::cerr << "ERROR: Could not create a temporary scene file.\n";
+            return make_shared<paged_bvh>(
+                std::string(), std::move(materials), budget_bytes);
+        }
+        const auto path = std::filesystem::path(pattern) / "scene.rtpb";
+        if (!write_new(builder, path, page_size)) {
+            std::cerr << "ERROR: Could not write scene file '"
+                      << path.string() << "'.\n";
+        }
+        auto scene = make_shared<paged_bvh>(
+            path.string(), std::move(materials), budget_bytes);
+        std::filesystem::remove_all(pattern, error);
+        return scene;
+    }
+};
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef IMAGE_STREAM_H
+#define IMAGE_STREAM_H
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "render_job.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class image_format {
+    ppm,  // двоичный PPM (P6), 8 бит на канал с гамма-коррекцией
+    pfm,  // PFM, линейные float без гамма-коррекции
+};
+
+// Файл изображения, который заполняется полосами строк в любом порядке.
+// Размер файла задается сразу после заголовка, и каждая полоса пишется по
+// своему смещению, поэтому в памяти не нужно держать весь кадр
+class image_stream_writer {
+ public:
+    image_stream_writer(const std::string &path,
+                        int width,
+                        int height,
+                        image_format format)
+        : out_(path, std::ios::binary), width_(width), height_(height),
+          format_(format) {
+        if (format_ == image_format::ppm) {
+            out_ << "P6\n" << width_ << ' ' << height_ << "\n255\n";
+        } else {
+            // отрицательный масштаб - порядок байт little-endian
+            out_ << "PF\n" << width_ << ' ' << height_ << "\n-1.0\n";
+        }
+        data_offset_ = out_.tellp();
+        const auto size = data_offset_ + std::streamoff(row_bytes()) * height_;
+        if (size > data_offset_) {
+            out_.seekp(size - 1);
+            out_.put('\0');
+        }
+    }
+
+    [[nodiscard]] bool good() const {
+        return static_cast<bool>(out_);
+    }
+
+    // записывает строки [first_row, first_row + rows) кадра. pixels -
+    // усредненные цвета этих строк, построчно сверху вниз
+    bool write_rows(int first_row, int rows, const std::vector<color> &pixels) {
+        std::vector<char> buffer(row_bytes() * rows);
+        int file_row = first_row;
+        for (int i = 0; i < rows; ++i) {
+            // в PFM строки хранятся снизу вверх
+            const auto row = format_ == image_format::pfm ? rows - 1 - i : i;
+            auto *out = &buffer[row_bytes() * row];
+            const auto *in = &pixels[size_t(i) * width_];
+            for (int j = 0; j < width_; ++j) {
+                if (format_ == image_format::ppm) {
+                    const auto rgb = write_color(in[j], 1);
+                    *out++ = static_cast<char>(rgb >> 16 & 0xff);
+                    *out++ = static_cast<char>(rgb >> 8 & 0xff);
+                    *out++ = static_cast<char>(rgb & 0xff);
+                } else {
+                    const float channels[3] = {in[j].x(), in[j].y(), in[j].z()};
+                    std::memcpy(out, channels, sizeof(channels));
+                    out += sizeof(channels);
+                }
+            }
+        }
+        if (format_ == image_format::pfm) {
+            file_row = height_ - first_row - rows;
+        }
+        out_.seekp(data_offset_ + std::streamoff(row_bytes()) * file_row);
+        out_.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        return good();
+    }
+
+ private:
+    std::ofstream out_;
+    int width_;
+    int height_;
+    image_format format_;
+    std::streamoff data_offset_ = 0;
+
+    [[nodiscard]] size_t row_bytes() const {
+        return size_t(width_) * (format_ == image_format::ppm ? 3 : 12);
+    }
+};
+
+struct stream_options {
+    int band_height = 64;  // строк в одной полосе
+    image_format format = image_format::ppm;
+
+    // настройки рендера полос. time_budget ограничивает весь кадр.
+    // Подавление шума, инкрементальный рендер, first_row/row_count и
+    // primary_cache не используются: полосы рисуются и записываются
+    // независимо, а кэш первых пересечений занимал бы память под весь кадр.
+    // Если задан guide с training_passes > 0, обучающие проходы делаются
+    // один раз по всему кадру до первой полосы, и полосы рисуются уже с
+    // обученным guide. Изображения проходов здесь не сохраняются: они
+    // заняли бы память под весь кадр. Копии сцены из scene_factory
+    // строятся один раз и передаются всем полосам через scene_replicas
+    render_options render;
+
+    // вызывается из вызывающего потока после записи каждой полосы
+    std::function<void(int rows_done, int rows_total)> on_band;
+};
+
+// Рисует кадр полосами по stream.band_height строк и сразу записывает
+// каждую готовую полосу в файл path. Пока полоса записывается, следующая
+// уже рисуется в фоне, поэтому одновременно в памяти не больше двух полос
+// и пиковое потребление памяти не зависит от высоты кадра.
+//
+// Если рендер остановлен по времени, файл получается неполным: готовые
+// тайлы прерванной полосы записываются, а ее недорисованные тайлы и
+// следующие полосы остаются черными, и возвращается timed_out. При ошибке
+// записи рендер прерывается со статусом cancelled
+inline render_status render_to_file(camera cam,
+                                    std::shared_ptr<const hittable> world,
+                                    const std::string &path,
+                                    stream_options stream = {}) {
+    cam.initialize();
+    const auto width = cam.image_width;
+    const auto height = cam.get_image_height();
+    const auto band = std::max(1, stream.band_height);
+    image_stream_writer writer(path, width, height, stream.format);
+    if (!writer.good()) {
+        std::cerr << "ERROR: Could not write image '" << path << "'.\n";
+        return render_status::cancelled;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto budget = stream.render.time_budget;
+    const auto out_of_time = [&] {
+        return budget.count() > 0 &&
+               std::chrono::steady_clock::now() - start >= budget;
+    };
+    // обучение и все полосы используют одни и те же копии сцены
+    worker_pool workers(world,
+                        stream.render.thread_count,
+                        stream.render.pin_threads,
+                        stream.render.topology);
+    if (stream.render.scene_factory) {
+        workers.build_replicas(stream.render.scene_factory);
+        stream.render.scene_replicas = workers.replicas();
+        stream.render.scene_factory = nullptr;
+    }
+    if (stream.render.guide) {
+        for (int pass = 0; pass < stream.render.training_passes; ++pass) {
+            train_guide_pass(cam,
+                             workers,
+                             *stream.render.guide,
+                             pass,
+                             stream.render.training_samples,
+                             0,
+                             height,
+                             {},
+                             out_of_time);
+            stream.render.guide->update();
+        }
+        stream.render.training_passes = 0;
+    }
+    workers.report_pinning();
+    stream.render.primary_cache.reset();
+
+    auto status = render_status::finished;
+    std::shared_ptr<render_job> finished;  // нарисованная, но не записанная
+    const auto write_band = [&](const render_job &job) {
+        if (!writer.write_rows(job.first_row(), job.height(), job.image())) {
+            std::cerr << "ERROR: Could not write image '" << path << "'.\n";
+            return false;
+        }
+        if (stream.on_band) {
+            stream.on_band(job.first_row() + job.height(), height);
+        }
+        return true;
+    };
+
+    for (int row = 0; row < height; row += band) {
+        auto options = stream.render;
+        options.first_row = row;
+        options.row_count = band;
+        options.denoise = false;
+        options.previous.reset();
+        if (budget.count() > 0) {
+            const auto left =
+                budget - std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::steady_clock::now() - start);
+            if (left.count() <= 0) {
+                status = render_status::timed_out;
+                break;
+            }
+            options.time_budget = left;
+        }
+
+        const auto job = render_job::start(cam, world, std::move(options));
+        if (finished && !write_band(*finished)) {
+            job->cancel();
+            job->wait();
+            return render_status::cancelled;
+        }
+        finished.reset();
+        status = job->wait();
+        if (status == render_status::finished ||
+            status == render_status::timed_out) {
+            finished = job;
+        }
+        if (status != render_status::finished) {
+            break;
+        }
+    }
+    if (finished && !write_band(*finished)) {
+        return render_status::cancelled;
+    }
+    return status;
+}
+
+#endif
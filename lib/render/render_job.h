@@ -0,0 +1,702 @@
+#ifndef RENDER_JOB_H
+#define RENDER_JOB_H
+
+#include "camera.h"
+#include "color.h"
+#include "denoiser.h"
+#include "hittable.h"
+#include "numa_topology.h"
+#include "path_guide.h"
+#include "sampler.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <thread>
+#include <vector>
+
+enum class render_status { running, finished, cancelled, timed_out };
+
+struct render_progress {
+    int tiles_done = 0;
+    int tiles_total = 0;
+    std::chrono::duration<double> elapsed{};
+};
+
+// Прямоугольник пикселей [x0, x1) x [y0, y1)
+struct tile_rect {
+    int x0, y0, x1, y1;
+};
+
+class render_job;
+
+struct render_options {
+    int thread_count = 0;  // 0 - по количеству ядер
+    int tile_size = 32;  // сторона квадратного тайла в пикселях
+
+    // рисуются только строки [first_row, first_row + row_count) кадра, и
+    // буферы задания выделяются только под них. Пиксели полосы совпадают с
+    // пикселями полного рендера. row_count = 0 - до конца кадра
+    int first_row = 0;
+    int row_count = 0;
+
+    // после истечения бюджета новые тайлы не начинаются, задание
+    // завершается со статусом timed_out. Ноль - без ограничения
+    std::chrono::milliseconds time_budget{0};
+
+    // вызывается после каждого готового тайла из рабочего потока. Вызовы
+    // сериализованы, поэтому обработчику не нужна своя синхронизация
+    std::function<void(const render_progress &)> on_progress;
+
+    // подавлять ли шум после рендера. Для этого на первом пересечении
+    // каждого луча собираются AOV (альбедо, нормаль, глубина)
+    bool denoise = false;
+    denoise_settings denoising;
+    bool capture_aovs = false;  // собирать AOV даже без подавления шума
+
+    // закреплять ли рабочие потоки за ядрами. Потоки раздаются узлам NUMA
+    // по очереди, а буферы тайлов каждый поток выделяет сам после
+    // закрепления, поэтому их страницы попадают в память своего узла
+    bool pin_threads = false;
+    // топология для закрепления. Если не задана, определяется по системе.
+    // numa_topology::simulated позволяет проверить распределение на машине
+    // с одним сокетом
+    std::optional<numa_topology> topology;
+    // если задана вместе с pin_threads, сцена строится заново на каждом
+    // узле потоком, закрепленным за этим узлом, и потоки узла пересекают
+    // лучи со своей копией. Иначе все потоки используют общую сцену
+    std::function<std::shared_ptr<const hittable>()> scene_factory;
+    // уже построенные копии сцены по узлам той же топологии (см.
+    // worker_pool::replicas). Если подходят, scene_factory не вызывается
+    std::vector<std::shared_ptr<const hittable>> scene_replicas;
+
+    // кэш первых пересечений. Один и тот же кэш можно передавать в
+    // несколько заданий подряд с той же камерой и сценой, тогда лучи из
+    // камеры не трассируются заново. Если nullptr, кэш не используется
+    std::shared_ptr<primary_hit_cache> primary_cache;
+
+    // собирать ли для каждого тайла path_footprint - все, чего касались его
+    // пути. Нужно, чтобы следующее задание могло перерисовать только тайлы,
+    // затронутые правкой сцены
+    bool record_footprints = false;
+    float footprint_cell_size = 1;  // сторона ячейки сетки в path_footprint
+
+    // инкрементальный рендер. Если задано завершенное задание с теми же
+    // камерой (см. camera::same_rendering) и размером тайла, собравшее
+    // footprints, перерисовываются только тайлы, которых могла коснуться
+    // правка edit, а остальные копируются из него. Иначе рисуется весь кадр
+    std::shared_ptr<const render_job> previous;
+    scene_edit edit;
+
+    // направленное семплирование путей. Если задан guide, перед рендером
+    // делается training_passes обучающих проходов по всему кадру по
+    // training_samples сэмплов на пиксель (округляется вверх до четного).
+    // Записи потоков сливаются в guide после каждого прохода. Основной
+    // рендер выбирает отскоки смесью обученного распределения и BSDF, а
+    // изображения проходов входят в итоговое image() с весами, обратными
+    // их дисперсии, так что время обучения не пропадает. Уже обученный
+    // guide можно передать в следующее задание с training_passes = 0
+    std::shared_ptr<path_guide> guide;
+    int training_passes = 0;
+    int training_samples = 1;
+};
+
+struct guide_pass_result {
+    bool complete = false;  // пройдены все строки
+    // оценка дисперсии яркости одного сэмпла, средняя по пикселям. Есть,
+    // только если проход рисовал изображение
+    double sample_variance = 0;
+};
+
+// Обучающий проход направленного семплирования по строкам
+// [first_row, first_row + rows) кадра камеры cam (уже инициализированной).
+// Потоки workers берут строки по очереди и трассируют training_samples
+// путей на пиксель со своей сценой (с закреплением - копией своего узла),
+// записывая их в свой recorder, а в конце сливают записи в guide. Сэмплер инициализируется номером прохода,
+// чтобы проходы видели разные пути. stop проверяется перед каждой строкой.
+// Распределения guide не перестраиваются: для этого после прохода нужен
+// guide.update().
+//
+// Если image не пуст, в него записываются средние цвета пикселей
+// (rows x image_width). Тогда пиксель рисуется двумя независимыми половинами
+// сэмплов, и по разнице половин оценивается дисперсия прохода
+template <class Stop>
+guide_pass_result train_guide_pass(const camera &cam,
+                                   worker_pool &workers,
+                                   path_guide &guide,
+                                   int pass,
+                                   int training_samples,
+                                   int first_row,
+                                   int rows,
+                                   std::span<color> image,
+                                   const Stop &stop) {
+    const bool halves = !image.empty();
+    auto training_cam = cam;
+    training_cam.samples_per_pixel =
+        halves ? std::max(1, (training_samples + 1) / 2)
+               : std::max(1, training_samples);
+    const auto scale = 1.0f / training_cam.samples_per_pixel;
+    std::atomic<int> next_row = 0;
+    std::atomic<int> rows_done = 0;
+    std::mutex variance_mutex;
+    double squared_differences = 0;
+    const auto luminance = [](const color &c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    };
+    const auto work = [&](int, const hittable &world) {
+        const auto s = make_sampler(
+            cam.sampling, sampling::hash_combine(cam.seed, 2 * pass + 1));
+        const auto second = make_sampler(
+            cam.sampling, sampling::hash_combine(cam.seed, 2 * pass + 2));
+        auto recorder = guide.make_recorder();
+        const path_guiding guiding{&guide, &recorder};
+        long long bounces = 0;
+        double differences = 0;
+        while (!stop()) {
+            const int row = next_row.fetch_add(1, std::memory_order_relaxed);
+            if (row >= rows) {
+                break;
+            }
+            for (int j = 0; j < cam.image_width; ++j) {
+                const auto first = training_cam.render_pixel(first_row + row,
+                                                             j,
+                                                             world,
+                                                             *s,
+                                                             bounces,
+                                                             nullptr,
+                                                             nullptr,
+                                                             nullptr,
+                                                             &guiding);
+                if (!halves) {
+                    continue;
+                }
+                const auto other = training_cam.render_pixel(first_row + row,
+                                                             j,
+                                                             world,
+                                                             *second,
+                                                             bounces,
+                                                             nullptr,
+                                                             nullptr,
+                                                             nullptr,
+                                                             &guiding);
+                image[size_t(row) * cam.image_width + j] =
+                    (first + other) * (scale / 2);
+                const auto d = luminance(first - other) * scale;
+                differences += d * d;
+            }
+            rows_done.fetch_add(1, std::memory_order_relaxed);
+        }
+        guide.merge(recorder);
+        std::lock_guard lock(variance_mutex);
+        squared_differences += differences;
+    };
+    workers.run(work);
+
+    guide_pass_result result;
+    result.complete = rows_done.load() == rows;
+    if (halves && rows > 0 && cam.image_width > 0) {
+        // разность двух независимых средних по n сэмплов имеет дисперсию
+        // 2 sigma^2 / n
+        result.sample_variance = squared_differences *
+                                 training_cam.samples_per_pixel / 2 /
+                                 (double(rows) * cam.image_width);
+    }
+    return result;
+}
+
+// Асинхронный рендер сцены. Создается через start, сразу возвращает
+// управление и рисует изображение тайлами в фоновых потоках.
+//
+// Во время рендера framebuffer() дает доступ к суммам сэмплов без
+// копирования. Читать можно только пиксели тайлов, для которых tile_done
+// вернул true: они больше не меняются. После wait() доступно итоговое
+// изображение image() (усредненное и, если включено, без шума).
+class render_job {
+ public:
+    static std::shared_ptr<render_job> start(camera cam,
+                                             std::shared_ptr<const hittable> world,
+                                             render_options options = {}) {
+        std::shared_ptr<render_job> job(
+            new render_job(std::move(cam), std::move(world), std::move(options)));
+        job->launch();
+        return job;
+    }
+
+    render_job(const render_job &) = delete;
+    render_job &operator=(const render_job &) = delete;
+
+    ~render_job() {
+        cancel();
+        if (controller_.joinable()) {
+            controller_.join();
+        }
+    }
+
+    // просит рабочие потоки остановиться. Уже начатые строки тайлов
+    // дорисовываются, поэтому задание завершается не мгновенно
+    void cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    // блокирует до окончания рендера и постобработки
+    render_status wait() {
+        std::unique_lock lock(mutex_);
+        done_cv_.wait(lock, [this] { return status_ != render_status::running; });
+        return status_;
+    }
+
+    [[nodiscard]] render_status status() const {
+        std::lock_guard lock(mutex_);
+        return status_;
+    }
+
+    [[nodiscard]] render_progress progress() const {
+        return {tiles_done_.load(std::memory_order_relaxed),
+                tile_count(),
+                std::chrono::steady_clock::now() - start_time_};
+    }
+
+    [[nodiscard]] int width() const {
+        return width_;
+    }
+
+    // высота полосы, которую рисует задание
+    [[nodiscard]] int height() const {
+        return height_;
+    }
+
+    // строка кадра, с которой начинается полоса
+    [[nodiscard]] int first_row() const {
+        return first_row_;
+    }
+
+    [[nodiscard]] int tile_count() const {
+        return tiles_x_ * tiles_y_;
+    }
+
+    // количество тайлов, которые рисуются заново. Меньше tile_count, если
+    // часть тайлов взята из options.previous
+    [[nodiscard]] int rendered_tile_count() const {
+        return static_cast<int>(pending_.size());
+    }
+
+    [[nodiscard]] tile_rect get_tile(int tile) const {
+        const int x0 = (tile % tiles_x_) * options_.tile_size;
+        const int y0 = (tile / tiles_x_) * options_.tile_size;
+        return {x0, y0, std::min(x0 + options_.tile_size, width_),
+                std::min(y0 + options_.tile_size, height_)};
+    }
+
+    [[nodiscard]] bool tile_done(int tile) const {
+        return tile_state_[tile].load(std::memory_order_acquire) != 0;
+    }
+
+    // суммы цветов сэмплов, построчно. Каждый пиксель содержит сумму
+    // samples_per_pixel сэмплов, если его тайл готов
+    [[nodiscard]] std::span<const color> framebuffer() const {
+        return framebuffer_;
+    }
+
+    [[nodiscard]] int samples_per_pixel() const {
+        return cam_.samples_per_pixel;
+    }
+
+    // итоговое изображение с усредненными цветами. Доступно после wait().
+    // Если были обучающие проходы, в него входят и их сэмплы, поэтому оно
+    // не равно framebuffer(), деленному на samples_per_pixel
+    [[nodiscard]] const std::vector<color> &image() const {
+        return image_;
+    }
+
+    // AOV первого пересечения. Пусты, если не были включены denoise или
+    // capture_aovs
+    [[nodiscard]] const aov_buffers &aovs() const {
+        return aovs_;
+    }
+
+    // места рабочих потоков, которые удалось закрепить, если был включен
+    // pin_threads. Доступны после wait()
+    [[nodiscard]] std::vector<worker_placement> placements() const {
+        return workers_.placements();
+    }
+
+    // сколько рабочих потоков и потоков построения копий сцены не удалось
+    // закрепить. Такие потоки работают без закрепления с общей сценой.
+    // Доступно после wait()
+    [[nodiscard]] int pin_failures() const {
+        return workers_.pin_failures();
+    }
+
+    // количество копий сцены, с которыми работали потоки: построенных
+    // scene_factory или взятых из scene_replicas
+    [[nodiscard]] int scene_replicas() const {
+        const auto &replicas = workers_.replicas();
+        return static_cast<int>(std::count_if(
+            replicas.begin(), replicas.end(), [](const auto &replica) {
+                return replica != nullptr;
+            }));
+    }
+
+    [[nodiscard]] double average_path_length() const {
+        const auto paths = double(traced_pixels_.load()) * cam_.samples_per_pixel;
+        return paths > 0 ? double(total_bounces_.load()) / paths : 0;
+    }
+
+    // записывает итоговое изображение в формате PPM. Вызывается после wait()
+    void write_ppm(std::ostream &out) const {
+        out << "P3\n" << width_ << ' ' << height_ << "\n255\n";
+        for (const auto &c : image_) {
+            auto rgb = write_color(c, 1);
+            auto b = rgb % 256;
+            rgb >>= 8;
+            auto g = rgb % 256;
+            rgb >>= 8;
+            auto r = rgb % 256;
+            out << r << ' ' << g << ' ' << b << '\n';
+        }
+    }
+
+ private:
+    camera cam_;
+    std::shared_ptr<const hittable> world_;
+    render_options options_;
+
+    int width_ = 0;
+    int height_ = 0;
+    int first_row_ = 0;
+    int tiles_x_ = 0;
+    int tiles_y_ = 0;
+
+    std::vector<color> framebuffer_;
+    std::vector<color> image_;
+    // сумма изображений обучающих проходов с весами, обратными дисперсии
+    // прохода, сумма весов и дисперсия сэмпла последнего прохода
+    std::vector<color> training_image_;
+    double training_weight_ = 0;
+    double training_variance_ = 0;
+    aov_buffers aovs_;
+    std::unique_ptr<std::atomic<uint8_t>[]> tile_state_;
+    std::vector<int> pending_;  // тайлы, которые нужно нарисовать
+    std::vector<path_footprint> footprints_;
+
+    worker_pool workers_;
+
+    std::atomic<int> next_tile_ = 0;
+    std::atomic<int> tiles_done_ = 0;
+    std::atomic<bool> cancelled_ = false;
+    std::atomic<bool> out_of_time_ = false;
+    std::atomic<long long> total_bounces_ = 0;
+    std::atomic<long long> traced_pixels_ = 0;
+
+    std::chrono::steady_clock::time_point start_time_;
+    std::chrono::steady_clock::time_point deadline_;
+
+    mutable std::mutex mutex_;
+    std::mutex progress_mutex_;
+    std::condition_variable done_cv_;
+    render_status status_ = render_status::running;
+    std::thread controller_;
+
+    render_job(camera cam, std::shared_ptr<const hittable> world, render_options options)
+        : cam_(std::move(cam)), world_(std::move(world)),
+          options_(std::move(options)),
+          workers_(world_,
+                   options_.thread_count,
+                   options_.pin_threads,
+                   options_.topology) {
+        cam_.initialize();
+        width_ = cam_.image_width;
+        const auto image_height = cam_.get_image_height();
+        first_row_ = std::clamp(options_.first_row, 0, image_height);
+        height_ = image_height - first_row_;
+        if (options_.row_count > 0) {
+            height_ = std::min(height_, options_.row_count);
+        }
+        options_.tile_size = std::max(1, options_.tile_size);
+        tiles_x_ = (width_ + options_.tile_size - 1) / options_.tile_size;
+        tiles_y_ = (height_ + options_.tile_size - 1) / options_.tile_size;
+
+        const auto pixel_count = size_t(width_) * height_;
+        framebuffer_.assign(pixel_count, color());
+        if (options_.denoise || options_.capture_aovs) {
+            aovs_.resize(pixel_count);
+        }
+        tile_state_ = std::make_unique<std::atomic<uint8_t>[]>(tile_count());
+        if (options_.primary_cache) {
+            options_.primary_cache->resize(
+                width_, image_height, cam_.samples_per_pixel);
+        }
+        if (options_.record_footprints) {
+            footprints_.assign(tile_count(),
+                               path_footprint(options_.footprint_cell_size));
+        }
+        reuse_previous();
+    }
+
+    // копирует из options_.previous тайлы, которых правка не коснулась, и
+    // составляет список остальных
+    void reuse_previous() {
+        const auto *previous = options_.previous.get();
+        const bool compatible =
+            previous != nullptr &&
+            previous->status() == render_status::finished &&
+            previous->width_ == width_ && previous->height_ == height_ &&
+            previous->first_row_ == first_row_ &&
+            previous->options_.tile_size == options_.tile_size &&
+            previous->cam_.same_rendering(cam_) &&
+            !previous->footprints_.empty() &&
+            previous->aovs_.depth.size() == aovs_.depth.size();
+        // ссылка на предыдущее задание больше не нужна, а цепочка из
+        // заданий держала бы в памяти все их буферы
+        options_.previous.reset();
+        for (int tile = 0; tile < tile_count(); ++tile) {
+            if (!compatible ||
+                previous->footprints_[tile].touched_by(options_.edit)) {
+                pending_.push_back(tile);
+                continue;
+            }
+            const auto rect = get_tile(tile);
+            for (int i = rect.y0; i < rect.y1; ++i) {
+                const auto first = size_t(i) * width_ + rect.x0;
+                const auto count = size_t(rect.x1 - rect.x0);
+                const auto copy = [&](const auto &from, auto &to) {
+                    std::copy_n(&from[first], count, &to[first]);
+                };
+                copy(previous->framebuffer_, framebuffer_);
+                if (!aovs_.depth.empty()) {
+                    copy(previous->aovs_.albedo, aovs_.albedo);
+                    copy(previous->aovs_.normal, aovs_.normal);
+                    copy(previous->aovs_.depth, aovs_.depth);
+                }
+            }
+            if (!footprints_.empty()) {
+                footprints_[tile] = previous->footprints_[tile];
+            }
+            tile_state_[tile].store(1, std::memory_order_relaxed);
+            tiles_done_.fetch_add(1, std::memory_order_relaxed);
+        }
+        // первые пересечения перерисовываемых тайлов могли измениться
+        if (!options_.edit.empty() && options_.primary_cache) {
+            for (const auto tile : pending_) {
+                const auto rect = get_tile(tile);
+                for (int i = rect.y0; i < rect.y1; ++i) {
+                    for (int j = rect.x0; j < rect.x1; ++j) {
+                        options_.primary_cache->invalidate(first_row_ + i,
+                                                           j);
+                    }
+                }
+            }
+        }
+    }
+
+    void launch() {
+        start_time_ = std::chrono::steady_clock::now();
+        deadline_ = start_time_ + options_.time_budget;
+        controller_ = std::thread([this] { run(); });
+    }
+
+    [[nodiscard]] bool should_stop() {
+        if (cancelled_.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        if (options_.time_budget.count() > 0 &&
+            std::chrono::steady_clock::now() >= deadline_) {
+            out_of_time_.store(true, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void run() {
+        if (!workers_.share_replicas(options_.scene_replicas)) {
+            workers_.build_replicas(options_.scene_factory);
+        }
+
+        if (options_.guide) {
+            train();
+        }
+
+        workers_.run(
+            [this](int, const hittable &world) { render_tiles(world); });
+        workers_.report_pinning();
+
+        finalize();
+
+        std::lock_guard lock(mutex_);
+        if (cancelled_.load()) {
+            status_ = render_status::cancelled;
+        } else if (out_of_time_.load()) {
+            status_ = render_status::timed_out;
+        } else {
+            status_ = render_status::finished;
+        }
+        done_cv_.notify_all();
+    }
+
+    // обучающие проходы. Изображение каждого завершенного прохода
+    // прибавляется к training_image_ с весом n / sigma^2, где n - сэмплов
+    // на пиксель, а sigma^2 - оценка дисперсии сэмпла прохода
+    void train() {
+        if (options_.training_passes <= 0) {
+            return;
+        }
+        const auto pixel_count = size_t(width_) * height_;
+        std::vector<color> pass_image(pixel_count);
+        for (int pass = 0;
+             pass < options_.training_passes && !should_stop();
+             ++pass) {
+            const auto result =
+                train_guide_pass(cam_,
+                                 workers_,
+                                 *options_.guide,
+                                 pass,
+                                 options_.training_samples,
+                                 first_row_,
+                                 height_,
+                                 std::span<color>(pass_image),
+                                 [this] { return should_stop(); });
+            options_.guide->update();
+            if (!result.complete) {
+                break;
+            }
+            const auto samples = 2 * ((options_.training_samples + 1) / 2);
+            const auto weight = inverse_variance_weight(samples,
+                                                        result.sample_variance);
+            if (training_image_.empty()) {
+                training_image_.assign(pixel_count, color());
+            }
+            for (size_t i = 0; i < pixel_count; ++i) {
+                training_image_[i] += pass_image[i] * static_cast<float>(weight);
+            }
+            training_weight_ += weight;
+            training_variance_ = result.sample_variance;
+        }
+    }
+
+    // вес изображения из samples сэмплов с дисперсией сэмпла variance.
+    // Нулевая дисперсия (например, черный кадр) не должна давать
+    // бесконечный вес, тогда веса пропорциональны числу сэмплов
+    static double inverse_variance_weight(int samples, double variance) {
+        return samples / std::max(variance, 1e-12);
+    }
+
+    // рабочий цикл потока со сценой world: берет следующий свободный тайл,
+    // пока они не кончатся или задание не остановят. Тайл рисуется в
+    // локальный буфер потока и затем копируется в framebuffer_
+    void render_tiles(const hittable &world) {
+        const auto s = make_sampler(cam_.sampling, cam_.seed);
+        const bool need_aovs = !aovs_.depth.empty();
+        const auto tile_pixels = size_t(options_.tile_size) * options_.tile_size;
+        std::vector<color> tile_colors(tile_pixels);
+        std::vector<surface_aov> tile_aovs(need_aovs ? tile_pixels : 0);
+        path_footprint footprint(options_.footprint_cell_size);
+        const bool need_footprints = !footprints_.empty();
+        const path_guiding guiding{options_.guide.get(), nullptr};
+        long long bounces = 0;
+        long long pixels = 0;
+        while (!should_stop()) {
+            const int next = next_tile_.fetch_add(1, std::memory_order_relaxed);
+            if (next >= rendered_tile_count()) {
+                break;
+            }
+            const int tile = pending_[next];
+            const auto rect = get_tile(tile);
+            footprint.clear();
+            bool interrupted = false;
+            const int tile_width = rect.x1 - rect.x0;
+            for (int i = rect.y0; i < rect.y1 && !interrupted; ++i) {
+                for (int j = rect.x0; j < rect.x1; ++j) {
+                    const auto local =
+                        size_t(i - rect.y0) * tile_width + (j - rect.x0);
+                    tile_colors[local] = cam_.render_pixel(
+                        first_row_ + i,
+                        j,
+                        world,
+                        *s,
+                        bounces,
+                        need_aovs ? &tile_aovs[local] : nullptr,
+                        options_.primary_cache.get(),
+                        need_footprints ? &footprint : nullptr,
+                        options_.guide ? &guiding : nullptr);
+                }
+                pixels += tile_width;
+                interrupted = cancelled_.load(std::memory_order_relaxed);
+            }
+            if (interrupted) {
+                break;
+            }
+            for (int i = rect.y0; i < rect.y1; ++i) {
+                const auto local = size_t(i - rect.y0) * tile_width;
+                const auto idx = size_t(i) * width_ + rect.x0;
+                std::copy_n(&tile_colors[local], tile_width, &framebuffer_[idx]);
+                for (int j = 0; need_aovs && j < tile_width; ++j) {
+                    const auto &aov = tile_aovs[local + j];
+                    aovs_.albedo[idx + j] = aov.albedo;
+                    aovs_.normal[idx + j] = aov.normal;
+                    aovs_.depth[idx + j] = aov.depth;
+                }
+            }
+            if (need_footprints) {
+                footprint.finish();
+                footprints_[tile] = footprint;
+            }
+            tile_state_[tile].store(1, std::memory_order_release);
+            const int done = tiles_done_.fetch_add(1, std::memory_order_relaxed) + 1;
+            if (options_.on_progress) {
+                std::lock_guard lock(progress_mutex_);
+                options_.on_progress(
+                    {done, tile_count(), std::chrono::steady_clock::now() - start_time_});
+            }
+        }
+        total_bounces_ += bounces;
+        traced_pixels_ += pixels;
+    }
+
+    // усредняет суммы сэмплов, смешивает их с обучающими проходами и
+    // подавляет шум. Дисперсия сэмпла основного рендера берется у
+    // последнего обучающего прохода: распределения с тех пор только
+    // уточнились, поэтому основной рендер получает не меньший вес, чем
+    // заслуживает. В недорисованных тайлах остаются обучающие проходы
+    void finalize() {
+        image_.resize(framebuffer_.size());
+        const auto scale = 1.0f / cam_.samples_per_pixel;
+        for (size_t i = 0; i < framebuffer_.size(); ++i) {
+            image_[i] = framebuffer_[i] * scale;
+        }
+        if (training_weight_ > 0) {
+            const auto final_weight = inverse_variance_weight(
+                cam_.samples_per_pixel, training_variance_);
+            const auto total = training_weight_ + final_weight;
+            for (int tile = 0; tile < tile_count(); ++tile) {
+                const bool done = tile_done(tile);
+                const auto rect = get_tile(tile);
+                for (int i = rect.y0; i < rect.y1; ++i) {
+                    for (int j = rect.x0; j < rect.x1; ++j) {
+                        const auto idx = size_t(i) * width_ + j;
+                        image_[idx] =
+                            done ? (training_image_[idx] +
+                                    image_[idx] *
+                                        static_cast<float>(final_weight)) /
+                                       static_cast<float>(total)
+                                 : training_image_[idx] /
+                                       static_cast<float>(training_weight_);
+                    }
+                }
+            }
+        }
+        if (options_.denoise && !cancelled_.load()) {
+            denoise(image_, aovs_, width_, height_, options_.denoising);
+        }
+    }
+};
+
+#endif
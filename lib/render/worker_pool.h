@@ -0,0 +1,182 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "hittable.h"
+#include "numa_topology.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Рабочие потоки рендера. С закреплением k-й поток ставится на ядро
+// numa_topology::place_worker(k) и пересекает лучи с копией сцены своего
+// узла, если она есть. Без закрепления все потоки используют общую сцену.
+//
+// Копии сцены можно построить фабрикой или взять у другого набора потоков
+// с той же топологией, поэтому несколько заданий подряд строят их один раз
+class worker_pool {
+ public:
+    using scene_factory = std::function<std::shared_ptr<const hittable>()>;
+
+    // thread_count = 0 - по количеству ядер. topology используется только
+    // с pin_threads, а если не задана, определяется по системе
+    worker_pool(std::shared_ptr<const hittable> world,
+                int thread_count,
+                bool pin_threads,
+                const std::optional<numa_topology> &topology = std::nullopt)
+        : world_(std::move(world)),
+          thread_count_(thread_count > 0
+                            ? thread_count
+                            : static_cast<int>(std::max(
+                                  1u, std::thread::hardware_concurrency()))),
+          pin_threads_(pin_threads) {
+        if (pin_threads_) {
+            topology_ = topology ? *topology : numa_topology::detect();
+        }
+    }
+
+    worker_pool(const worker_pool &) = delete;
+    worker_pool &operator=(const worker_pool &) = delete;
+
+    [[nodiscard]] int thread_count() const {
+        return thread_count_;
+    }
+
+    // строит копию сцены на каждом узле. Поток закрепляется за первым ядром
+    // узла до вызова фабрики, поэтому по правилу первого касания память
+    // копии выделяется на этом узле. Если закрепить не удалось, копия не
+    // строится: она не была бы локальной, и потоки узла берут общую сцену.
+    // Без закрепления ничего не делает
+    void build_replicas(const scene_factory &factory) {
+        if (!pin_threads_ || !factory) {
+            return;
+        }
+        const auto &nodes = topology_.nodes();
+        replicas_.assign(nodes.size(), nullptr);
+        std::vector<std::thread> builders;
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            builders.emplace_back([this, n, &nodes, &factory] {
+                if (nodes[n].cpus.empty()) {
+                    return;  // на узел не попадет ни один работник
+                }
+                if (!pin_current_thread(nodes[n].cpus.front())) {
+                    builder_failures_.fetch_add(1);
+                    return;
+                }
+                replicas_[n] = factory();
+            });
+        }
+        for (auto &th : builders) {
+            th.join();
+        }
+    }
+
+    // берет копии, построенные другим набором потоков (см. replicas()).
+    // Они подходят, только если их столько же, сколько узлов в топологии
+    bool share_replicas(
+        const std::vector<std::shared_ptr<const hittable>> &replicas) {
+        if (!pin_threads_ || replicas.size() != topology_.nodes().size()) {
+            return false;
+        }
+        replicas_ = replicas;
+        return true;
+    }
+
+    // копии сцены по узлам, в порядке топологии. Пустые места - узлы, для
+    // которых копию построить не удалось
+    [[nodiscard]] const std::vector<std::shared_ptr<const hittable>> &
+    replicas() const {
+        return replicas_;
+    }
+
+    // выполняет work(k, world) в thread_count потоках и ждет их, где world -
+    // сцена, с которой работает поток k. Без закрепления нулевым работником
+    // служит текущий поток. С закреплением он только ждет: иначе он остался
+    // бы закрепленным за одним ядром, а потоки, которые он потом запускает
+    // для подавления шума, унаследовали бы эту маску
+    template <class Work>
+    void run(const Work &work) {
+        const int first_spawned = pin_threads_ ? 0 : 1;
+        if (pin_threads_) {
+            worker_placements_.assign(thread_count_, std::nullopt);
+        }
+        std::vector<std::thread> pool;
+        for (int k = first_spawned; k < thread_count_; ++k) {
+            pool.emplace_back([this, &work, k] { work(k, *bind(k)); });
+        }
+        if (first_spawned > 0) {
+            work(0, *world_);
+        }
+        for (auto &th : pool) {
+            th.join();
+        }
+    }
+
+    // места рабочих потоков, которые удалось закрепить в последнем run()
+    [[nodiscard]] std::vector<worker_placement> placements() const {
+        std::vector<worker_placement> placements;
+        for (const auto &placement : worker_placements_) {
+            if (placement) {
+                placements.push_back(*placement);
+            }
+        }
+        return placements;
+    }
+
+    // сколько рабочих потоков последнего run() и потоков построения копий
+    // не удалось закрепить
+    [[nodiscard]] int pin_failures() const {
+        return builder_failures_.load() +
+               static_cast<int>(std::count(worker_placements_.begin(),
+                                           worker_placements_.end(),
+                                           std::nullopt));
+    }
+
+    // сообщает о потоках, которые не удалось закрепить
+    void report_pinning() const {
+        if (const auto failures = pin_failures(); failures > 0) {
+            std::cerr << "ERROR: Could not pin " << failures
+                      << " thread(s) to their cores; they ran unpinned.\n";
+        }
+    }
+
+ private:
+    std::shared_ptr<const hittable> world_;
+    int thread_count_;
+    bool pin_threads_;
+    numa_topology topology_;
+    // место каждого рабочего потока или nullopt, если закрепить не удалось
+    std::vector<std::optional<worker_placement>> worker_placements_;
+    std::atomic<int> builder_failures_ = 0;
+    // копии сцены по узлам, в порядке topology_.nodes()
+    std::vector<std::shared_ptr<const hittable>> replicas_;
+
+    // с закреплением закрепляет текущий поток за ядром работника worker и
+    // возвращает сцену, с которой ему работать: копию его узла, если она
+    // есть. Место записывается, только если закрепление удалось
+    const hittable *bind(int worker) {
+        if (!pin_threads_) {
+            return world_.get();
+        }
+        const auto placement = topology_.place_worker(worker);
+        if (!pin_current_thread(placement.cpu)) {
+            worker_placements_[worker].reset();
+            return world_.get();
+        }
+        worker_placements_[worker] = placement;
+        if (!replicas_.empty()) {
+            const auto &replica =
+                replicas_[topology_.node_index(placement.node)];
+            if (replica) {
+                return replica.get();
+            }
+        }
+        return world_.get();
+    }
+};
+
+#endif
@@ -0,0 +1,363 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Точка единичного квадрата [0, 1)^2
+struct point2 {
+    float x = 0;
+    float y = 0;
+};
+
+// Источник чисел из [0, 1) для одного сэмпла пикселя. Каждый вызов get_1d
+// или get_2d занимает следующее измерение: камера берет первые два
+// измерения на смещение внутри пикселя, далее каждый отскок берет столько
+// измерений, сколько нужно материалу. Одинаковые (i, j, sample_index, seed)
+// всегда дают одинаковые числа, поэтому рендер детерминирован независимо от
+// количества потоков
+class sampler {
+ public:
+    virtual ~sampler() = default;
+
+    // начинает сэмпл с номером sample_index пикселя в i-ой строке j-ом
+    // столбце. Сбрасывает счетчик измерений
+    virtual void start_pixel_sample(int i, int j, int sample_index) = 0;
+
+    virtual float get_1d() = 0;
+    virtual point2 get_2d() = 0;
+};
+
+namespace sampling {
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// хеш-функция из PCG (Jarzynski, Olano, "Hash Functions for GPU Rendering")
+inline uint32_t hash(uint32_t x) {
+    const uint32_t state = x * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// переводит 32 бита в число из [0, 1). Берутся старшие 24 бита, чтобы
+// результат точно представлялся во float и не округлялся до единицы
+inline float to_unit_float(uint32_t x) {
+    return static_cast<float>(x >> 8) * 0x1p-24f;
+}
+
+// Перестановка Лайне-Карраса. Для каждого бита зависит только от младших
+// битов, поэтому после разворота битов дает вложенное равномерное
+// скремблирование Оуэна
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    return reverse_bits(x);
+}
+
+// Первые два измерения последовательности Соболя. Вместе они образуют
+// (0, 2)-последовательность: любые 2^k подряд идущих точек стратифицированы
+// по всем элементарным интервалам площади 2^-k
+inline uint32_t sobol_dim0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_dim1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if ((index & 1u) != 0) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+// Ранги void-and-cluster для тайла blue noise размера
+// blue_noise_size x blue_noise_size (Ulichney, "The void-and-cluster method
+// for dither array generation"). Строится один раз при первом обращении
+inline constexpr int blue_noise_size = 64;
+
+inline const std::vector<float> &blue_noise_tile() {
+    static const std::vector<float> tile = [] {
+        constexpr int n = blue_noise_size;
+        constexpr int count = n * n;
+        constexpr float sigma = 1.5f;
+
+        // энергия гауссова ядра для каждого тороидального смещения
+        std::vector<float> kernel(count);
+        for (int dy = 0; dy < n; ++dy) {
+            for (int dx = 0; dx < n; ++dx) {
+                const auto wx = static_cast<float>(std::min(dx, n - dx));
+                const auto wy = static_cast<float>(std::min(dy, n - dy));
+                kernel[dy * n + dx] =
+                    std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+            }
+        }
+
+        std::vector<uint8_t> pattern(count, 0);
+        std::vector<float> energy(count, 0);
+        const auto splat = [&](int idx, float sign) {
+            const int px = idx % n;
+            const int py = idx / n;
+            for (int y = 0; y < n; ++y) {
+                const int dy = (y - py + n) % n;
+                for (int x = 0; x < n; ++x) {
+                    const int dx = (x - px + n) % n;
+                    energy[y * n + x] += sign * kernel[dy * n + dx];
+                }
+            }
+        };
+        // самый плотный кластер - единица с наибольшей энергией,
+        // самая большая пустота - ноль с наименьшей
+        const auto tightest_cluster = [&] {
+            int best = -1;
+            for (int i = 0; i < count; ++i) {
+                if (pattern[i] && (best < 0 || energy[i] > energy[best])) {
+                    best = i;
+                }
+            }
+            return best;
+        };
+        const auto largest_void = [&] {
+            int best = -1;
+            for (int i = 0; i < count; ++i) {
+                if (!pattern[i] && (best < 0 || energy[i] < energy[best])) {
+                    best = i;
+                }
+            }
+            return best;
+        };
+
+        // начальный паттерн: десятая часть точек, разбросанных
+        // детерминированно, затем выравнивается переносом точек из
+        // кластеров в пустоты
+        const int initial = count / 10;
+        int placed = 0;
+        for (uint32_t i = 0; placed < initial; ++i) {
+            const auto idx = static_cast<int>(hash(i) % count);
+            if (!pattern[idx]) {
+                pattern[idx] = 1;
+                splat(idx, 1);
+                ++placed;
+            }
+        }
+        while (true) {
+            const int cluster = tightest_cluster();
+            pattern[cluster] = 0;
+            splat(cluster, -1);
+            const int hole = largest_void();
+            if (hole == cluster) {
+                pattern[cluster] = 1;
+                splat(cluster, 1);
+                break;
+            }
+            pattern[hole] = 1;
+            splat(hole, 1);
+        }
+
+        std::vector<int> rank(count, 0);
+        const auto prototype = pattern;
+        const auto prototype_energy = energy;
+
+        // фаза 1: ранжирование точек начального паттерна
+        for (int r = initial - 1; r >= 0; --r) {
+            const int cluster = tightest_cluster();
+            pattern[cluster] = 0;
+            splat(cluster, -1);
+            rank[cluster] = r;
+        }
+
+        // фазы 2 и 3: заполнение пустот. Самый плотный кластер нулей
+        // совпадает с самой большой пустотой единиц, так как суммарная
+        // энергия всех пикселей постоянна
+        pattern = prototype;
+        energy = prototype_energy;
+        for (int r = initial; r < count; ++r) {
+            const int hole = largest_void();
+            pattern[hole] = 1;
+            splat(hole, 1);
+            rank[hole] = r;
+        }
+
+        std::vector<float> result(count);
+        for (int i = 0; i < count; ++i) {
+            result[i] = (static_cast<float>(rank[i]) + 0.5f) / count;
+        }
+        return result;
+    }();
+    return tile;
+}
+
+}  // namespace sampling
+
+// Независимые равномерные числа. Генератор переинициализируется хешем
+// координат сэмпла, поэтому результат не зависит от порядка обхода пикселей
+class independent_sampler : public sampler {
+ public:
+    explicit independent_sampler(uint32_t seed = 0) : seed_(seed) {
+    }
+
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        state_ = sampling::hash_combine(
+            sampling::hash_combine(sampling::hash_combine(seed_, i), j),
+            sample_index);
+    }
+
+    float get_1d() override {
+        state_ = sampling::hash(state_);
+        return sampling::to_unit_float(state_);
+    }
+
+    point2 get_2d() override {
+        const auto x = get_1d();
+        return {x, get_1d()};
+    }
+
+ private:
+    uint32_t seed_;
+    uint32_t state_ = 0;
+};
+
+// Последовательность Соболя со скремблированием Оуэна (Burley, "Practical
+// Hash-based Owen Scrambling"). Каждая пара измерений берет 2D
+// последовательность Соболя с собственным перемешиванием индекса и
+// собственным скремблированием, так что сэмплы пикселя стратифицированы в
+// каждом измерении, а разные пиксели и измерения некоррелированы
+class sobol_sampler : public sampler {
+ public:
+    explicit sobol_sampler(uint32_t seed = 0) : seed_(seed) {
+    }
+
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        pixel_seed_ =
+            sampling::hash_combine(sampling::hash_combine(seed_, i), j);
+        index_ = static_cast<uint32_t>(sample_index);
+        dimension_ = 0;
+    }
+
+    float get_1d() override {
+        const auto dim_seed = next_dimension_seed();
+        const auto index = shuffled_index(dim_seed);
+        return sampling::to_unit_float(sampling::nested_uniform_scramble(
+            sampling::sobol_dim0(index), sampling::hash(dim_seed)));
+    }
+
+    point2 get_2d() override {
+        const auto dim_seed = next_dimension_seed();
+        const auto index = shuffled_index(dim_seed);
+        const auto x = sampling::nested_uniform_scramble(
+            sampling::sobol_dim0(index), sampling::hash_combine(dim_seed, 0));
+        const auto y = sampling::nested_uniform_scramble(
+            sampling::sobol_dim1(index), sampling::hash_combine(dim_seed, 1));
+        return {sampling::to_unit_float(x), sampling::to_unit_float(y)};
+    }
+
+ private:
+    uint32_t seed_;
+    uint32_t pixel_seed_ = 0;
+    uint32_t index_ = 0;
+    uint32_t dimension_ = 0;
+
+    uint32_t next_dimension_seed() {
+        return sampling::hash_combine(pixel_seed_, dimension_++);
+    }
+
+    [[nodiscard]] uint32_t shuffled_index(uint32_t dim_seed) const {
+        return sampling::nested_uniform_scramble(index_, dim_seed);
+    }
+};
+
+// Скремблированная последовательность Соболя, общая для всех пикселей,
+// со сдвигом Кранли-Паттерсона на значение из тайла blue noise. Ошибка
+// соседних пикселей получается антикоррелированной, и шум при малом числе
+// сэмплов выглядит как высокочастотный, который легче убирается
+// фильтрацией
+class blue_noise_sampler : public sampler {
+ public:
+    explicit blue_noise_sampler(uint32_t seed = 0)
+        : seed_(seed), tile_(sampling::blue_noise_tile()) {
+    }
+
+    void start_pixel_sample(int i, int j, int sample_index) override {
+        i_ = i;
+        j_ = j;
+        index_ = static_cast<uint32_t>(sample_index);
+        dimension_ = 0;
+    }
+
+    float get_1d() override {
+        const auto dim_seed = sampling::hash_combine(seed_, dimension_++);
+        const auto index = sampling::nested_uniform_scramble(index_, dim_seed);
+        const auto x = sampling::nested_uniform_scramble(
+            sampling::sobol_dim0(index), sampling::hash(dim_seed));
+        return rotate(sampling::to_unit_float(x), dim_seed, 0);
+    }
+
+    point2 get_2d() override {
+        const auto dim_seed = sampling::hash_combine(seed_, dimension_++);
+        const auto index = sampling::nested_uniform_scramble(index_, dim_seed);
+        const auto x = sampling::nested_uniform_scramble(
+            sampling::sobol_dim0(index), sampling::hash_combine(dim_seed, 0));
+        const auto y = sampling::nested_uniform_scramble(
+            sampling::sobol_dim1(index), sampling::hash_combine(dim_seed, 1));
+        return {rotate(sampling::to_unit_float(x), dim_seed, 0),
+                rotate(sampling::to_unit_float(y), dim_seed, 1)};
+    }
+
+ private:
+    uint32_t seed_;
+    const std::vector<float> &tile_;
+    int i_ = 0;
+    int j_ = 0;
+    uint32_t index_ = 0;
+    uint32_t dimension_ = 0;
+
+    // каждое измерение читает тайл с собственным тороидальным сдвигом,
+    // чтобы смещения разных измерений не совпадали
+    [[nodiscard]] float rotate(float x, uint32_t dim_seed, uint32_t axis) const {
+        constexpr int n = sampling::blue_noise_size;
+        const auto shift = sampling::hash_combine(dim_seed, axis + 2);
+        const int row = (i_ + static_cast<int>(shift % n)) % n;
+        const int col = (j_ + static_cast<int>((shift / n) % n)) % n;
+        const auto rotated = x + tile_[row * n + col];
+        return rotated >= 1 ? rotated - 1 : rotated;
+    }
+};
+
+enum class sampler_kind { independent, sobol, blue_noise };
+
+inline std::unique_ptr<sampler> make_sampler(sampler_kind kind,
+                                             uint32_t seed = 0) {
+    switch (kind) {
+        case sampler_kind::sobol:
+            return std::make_unique<sobol_sampler>(seed);
+        case sampler_kind::blue_noise:
+            return std::make_unique<blue_noise_sampler>(seed);
+        case sampler_kind::independent:
+        default:
+            return std::make_unique<independent_sampler>(seed);
+    }
+}
+
+#endif
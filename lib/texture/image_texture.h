@@ -0,0 +1,343 @@
+#ifndef IMAGE_TEXTURE_H
+#define IMAGE_TEXTURE_H
+
+#include "color.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Формат файла тайловой текстуры:
+//   tiled_texture_header
+//   уровень 0: тайлы построчно, затем уровень 1 и т.д.
+// Каждый тайл занимает tile_size * tile_size * 3 байт (RGB, гамма 2, как у
+// write_color). Крайние тайлы дополняются копиями крайних текселей, поэтому
+// все тайлы одного размера и смещение любого тайла вычисляется без таблиц
+struct tiled_texture_header {
+    char magic[4] = {'R', 'T', 'T', 'X'};
+    uint32_t version = 1;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t tile_size = 0;
+    uint32_t levels = 0;
+};
+
+namespace texturing {
+
+inline uint32_t level_size(uint32_t size, uint32_t level) {
+    return std::max(1u, size >> level);
+}
+
+inline uint32_t tiles_along(uint32_t size, uint32_t tile_size) {
+    return (size + tile_size - 1) / tile_size;
+}
+
+// Читает изображение PPM (P3 или P6 с maxval <= 255) в массив RGB
+inline bool read_ppm(const std::string &path,
+                     uint32_t &width,
+                     uint32_t &height,
+                     std::vector<uint8_t> &rgb) {
+    std::ifstream in(path, std::ios::binary);
+    std::string format;
+    int maxval = 0;
+    in >> format >> width >> height >> maxval;
+    if (!in || (format != "P3" && format != "P6") || maxval <= 0 ||
+        maxval > 255) {
+        return false;
+    }
+    rgb.resize(size_t(width) * height * 3);
+    if (format == "P6") {
+        in.get();  // один пробельный символ после заголовка
+        in.read(reinterpret_cast<char *>(rgb.data()),
+                static_cast<std::streamsize>(rgb.size()));
+    } else {
+        for (auto &c : rgb) {
+            int value = 0;
+            in >> value;
+            c = static_cast<uint8_t>(value);
+        }
+    }
+    if (!in) {
+        return false;
+    }
+    if (maxval != 255) {
+        for (auto &c : rgb) {
+            c = static_cast<uint8_t>(c * 255 / maxval);
+        }
+    }
+    return true;
+}
+
+// Уменьшает изображение вдвое по каждой оси усреднением 2x2. Усреднение
+// делается в линейном пространстве, иначе дальние уровни темнеют
+inline std::vector<uint8_t> downsample(const std::vector<uint8_t> &rgb,
+                                       uint32_t width,
+                                       uint32_t height) {
+    const auto w = level_size(width, 1);
+    const auto h = level_size(height, 1);
+    std::vector<uint8_t> result(size_t(w) * h * 3);
+    for (uint32_t y = 0; y < h; ++y) {
+        for (uint32_t x = 0; x < w; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                float sum = 0;
+                for (uint32_t dy = 0; dy < 2; ++dy) {
+                    for (uint32_t dx = 0; dx < 2; ++dx) {
+                        const auto sx = std::min(2 * x + dx, width - 1);
+                        const auto sy = std::min(2 * y + dy, height - 1);
+                        const float v =
+                            rgb[(size_t(sy) * width + sx) * 3 + c] / 255.0f;
+                        sum += v * v;
+                    }
+                }
+                result[(size_t(y) * w + x) * 3 + c] = static_cast<uint8_t>(
+                    std::lround(std::sqrt(sum / 4) * 255));
+            }
+        }
+    }
+    return result;
+}
+
+}  // namespace texturing
+
+// Переводит изображение RGB в тайловый файл с полной цепочкой mip-уровней.
+// Преобразование делается один раз заранее. После него текстура читается
+// страницами и целиком в памяти не хранится
+inline bool write_tiled_texture(const std::string &path,
+                                std::vector<uint8_t> rgb,
+                                uint32_t width,
+                                uint32_t height,
+                                uint32_t tile_size = 64) {
+    using namespace texturing;
+    tiled_texture_header header;
+    header.width = width;
+    header.height = height;
+    header.tile_size = tile_size;
+    header.levels = 1;
+    while (level_size(width, header.levels - 1) > 1 ||
+           level_size(height, header.levels - 1) > 1) {
+        ++header.levels;
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    std::vector<uint8_t> tile(size_t(tile_size) * tile_size * 3);
+    for (uint32_t level = 0; level < header.levels; ++level) {
+        const auto w = level_size(width, level);
+        const auto h = level_size(height, level);
+        for (uint32_t ty = 0; ty < tiles_along(h, tile_size); ++ty) {
+            for (uint32_t tx = 0; tx < tiles_along(w, tile_size); ++tx) {
+                for (uint32_t y = 0; y < tile_size; ++y) {
+                    const auto sy = std::min(ty * tile_size + y, h - 1);
+                    for (uint32_t x = 0; x < tile_size; ++x) {
+                        const auto sx = std::min(tx * tile_size + x, w - 1);
+                        std::memcpy(&tile[(size_t(y) * tile_size + x) * 3],
+                                    &rgb[(size_t(sy) * w + sx) * 3],
+                                    3);
+                    }
+                }
+                out.write(reinterpret_cast<const char *>(tile.data()),
+                          static_cast<std::streamsize>(tile.size()));
+            }
+        }
+        if (level + 1 < header.levels) {
+            rgb = downsample(rgb, w, h);
+        }
+    }
+    return static_cast<bool>(out);
+}
+
+// Переводит PPM в тайловый файл. Возвращает false при ошибке чтения или
+// записи
+inline bool convert_ppm_to_tiled(const std::string &ppm_path,
+                                 const std::string &tiled_path,
+                                 uint32_t tile_size = 64) {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> rgb;
+    if (!texturing::read_ppm(ppm_path, width, height, rgb)) {
+        return false;
+    }
+    return write_tiled_texture(
+        tiled_path, std::move(rgb), width, height, tile_size);
+}
+
+// Текстура из тайлового файла. Тайлы подгружаются по требованию через общий
+// texture_cache, поэтому суммарный размер текстур сцены может во много раз
+// превышать бюджет кэша. Уровень детализации выбирается по footprint, между
+// соседними уровнями делается трилинейная интерполяция, координаты
+// повторяются (wrap)
+class image_texture : public texture {
+ public:
+    image_texture(const std::string &tiled_path,
+                  std::shared_ptr<texture_cache> cache)
+        : cache_(std::move(cache)) {
+        fd_ = ::open(tiled_path.c_str(), O_RDONLY);
+        char raw_header[sizeof(header_)];
+        const bool header_read =
+            fd_ >= 0 &&
+            ::pread(fd_, raw_header, sizeof(raw_header), 0) ==
+                static_cast<ssize_t>(sizeof(raw_header));
+        if (header_read) {
+            std::memcpy(&header_, raw_header, sizeof(header_));
+        }
+        if (!header_read || std::memcmp(header_.magic, "RTTX", 4) != 0 ||
+            header_.version != tiled_texture_header{}.version ||
+            header_.tile_size == 0 || header_.levels == 0) {
+            std::cerr << "ERROR: Could not load texture file '" << tiled_path
+                      << "'.\n";
+            header_ = {};
+            return;
+        }
+        id_ = cache_->register_texture();
+
+        // смещения начала каждого уровня в файле
+        auto offset = static_cast<off_t>(sizeof(header_));
+        for (uint32_t level = 0; level < header_.levels; ++level) {
+            level_offsets_.push_back(offset);
+            offset += static_cast<off_t>(tiles_x(level)) * tiles_y(level) *
+                      static_cast<off_t>(page_bytes());
+        }
+    }
+
+    image_texture(const image_texture &) = delete;
+    image_texture &operator=(const image_texture &) = delete;
+
+    ~image_texture() override {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    [[nodiscard]] color value(float u, float v, float footprint) const override {
+        // если данных нет, возвращается бирюзовый цвет, чтобы ошибку было
+        // видно на изображении
+        if (header_.levels == 0) {
+            return color(0, 1, 1);
+        }
+
+        u -= std::floor(u);
+        v = 1 - (v - std::floor(v));  // строки изображения идут сверху вниз
+
+        const auto max_level = static_cast<float>(header_.levels - 1);
+        const auto texels = footprint * static_cast<float>(header_.width);
+        const auto lod =
+            texels > 1 ? std::min(std::log2(texels), max_level) : 0.0f;
+        const auto level = static_cast<uint32_t>(lod);
+        const auto t = lod - static_cast<float>(level);
+
+        page_memo memo;
+        auto c = bilinear(level, u, v, memo);
+        if (t > 0 && level + 1 < header_.levels) {
+            c = (1 - t) * c + t * bilinear(level + 1, u, v, memo);
+        }
+        return c;
+    }
+
+    [[nodiscard]] uint32_t width() const {
+        return header_.width;
+    }
+
+    [[nodiscard]] uint32_t height() const {
+        return header_.height;
+    }
+
+    [[nodiscard]] uint32_t levels() const {
+        return header_.levels;
+    }
+
+ private:
+    std::shared_ptr<texture_cache> cache_;
+    int fd_ = -1;
+    tiled_texture_header header_;
+    uint32_t id_ = 0;
+    std::vector<off_t> level_offsets_;
+
+    // последняя запрошенная страница. Соседние тексели билинейной выборки
+    // почти всегда лежат в одном тайле, и кэш не дергается повторно
+    struct page_memo {
+        texture_page_key key{~0u, ~0u, ~0u, ~0u};
+        std::shared_ptr<const texture_page> page;
+    };
+
+    [[nodiscard]] size_t page_bytes() const {
+        return size_t(header_.tile_size) * header_.tile_size * 3;
+    }
+
+    [[nodiscard]] uint32_t tiles_x(uint32_t level) const {
+        return texturing::tiles_along(
+            texturing::level_size(header_.width, level), header_.tile_size);
+    }
+
+    [[nodiscard]] uint32_t tiles_y(uint32_t level) const {
+        return texturing::tiles_along(
+            texturing::level_size(header_.height, level), header_.tile_size);
+    }
+
+    [[nodiscard]] color bilinear(uint32_t level,
+                                 float u,
+                                 float v,
+                                 page_memo &memo) const {
+        const auto w = static_cast<int>(texturing::level_size(header_.width, level));
+        const auto h =
+            static_cast<int>(texturing::level_size(header_.height, level));
+        const auto x = u * w - 0.5f;
+        const auto y = v * h - 0.5f;
+        const auto x0 = static_cast<int>(std::floor(x));
+        const auto y0 = static_cast<int>(std::floor(y));
+        const auto fx = x - x0;
+        const auto fy = y - y0;
+        const auto wrap = [](int i, int n) { return ((i % n) + n) % n; };
+
+        const auto c00 = texel(level, wrap(x0, w), wrap(y0, h), memo);
+        const auto c10 = texel(level, wrap(x0 + 1, w), wrap(y0, h), memo);
+        const auto c01 = texel(level, wrap(x0, w), wrap(y0 + 1, h), memo);
+        const auto c11 = texel(level, wrap(x0 + 1, w), wrap(y0 + 1, h), memo);
+        return (1 - fy) * ((1 - fx) * c00 + fx * c10) +
+               fy * ((1 - fx) * c01 + fx * c11);
+    }
+
+    [[nodiscard]] color texel(uint32_t level, int x, int y, page_memo &memo) const {
+        const auto ts = header_.tile_size;
+        const texture_page_key key{id_, level, x / ts, y / ts};
+        if (!(key == memo.key)) {
+            memo.key = key;
+            memo.page = cache_->get(key, [&] { return load_page(key); });
+        }
+        const auto local = (size_t(y % ts) * ts + x % ts) * 3;
+        const auto *p = &memo.page->texels[local];
+        // обратное к linear_to_gamma преобразование
+        const auto to_linear = [](uint8_t c) {
+            const auto g = c / 255.0f;
+            return g * g;
+        };
+        return color(to_linear(p[0]), to_linear(p[1]), to_linear(p[2]));
+    }
+
+    [[nodiscard]] std::shared_ptr<const texture_page>
+    load_page(const texture_page_key &key) const {
+        auto page = std::make_shared<texture_page>();
+        page->texels.resize(page_bytes());
+        const auto tile =
+            static_cast<off_t>(key.tile_y) * tiles_x(key.level) + key.tile_x;
+        const auto offset =
+            level_offsets_[key.level] + tile * static_cast<off_t>(page_bytes());
+        if (::pread(fd_, page->texels.data(), page_bytes(), offset) !=
+            static_cast<ssize_t>(page_bytes())) {
+            // поврежденный файл дает черные тексели вместо падения рендера
+            std::fill(page->texels.begin(), page->texels.end(), 0);
+        }
+        return page;
+    }
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "color.h"
+
+// Текстура - цвет как функция координат (u, v) на поверхности.
+// footprint - размер области, которую покрывает луч, в единицах (u, v).
+// По нему текстуры с mip-уровнями выбирают уровень детализации
+class texture {
+ public:
+    virtual ~texture() = default;
+
+    [[nodiscard]] virtual color value(float u, float v, float footprint) const = 0;
+};
+
+class solid_color : public texture {
+ public:
+    explicit solid_color(const color &c) : color_value(c) {
+    }
+
+    [[nodiscard]] color value(float, float, float) const override {
+        return color_value;
+    }
+
+ private:
+    color color_value;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Ключ страницы: текстура, mip-уровень и координаты тайла на уровне
+struct texture_page_key {
+    uint32_t texture_id = 0;
+    uint32_t level = 0;
+    uint32_t tile_x = 0;
+    uint32_t tile_y = 0;
+
+    bool operator==(const texture_page_key &) const = default;
+};
+
+struct texture_page_key_hash {
+    size_t operator()(const texture_page_key &k) const {
+        uint64_t h = k.texture_id;
+        h = h * 0x9e3779b97f4a7c15ull + k.level;
+        h = h * 0x9e3779b97f4a7c15ull + k.tile_x;
+        h = h * 0x9e3779b97f4a7c15ull + k.tile_y;
+        return static_cast<size_t>(h ^ (h >> 29));
+    }
+};
+
+// Страница - один тайл одного mip-уровня, тексели построчно по 3 байта
+struct texture_page {
+    std::vector<uint8_t> texels;
+};
+
+struct texture_cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t resident_bytes = 0;
+    size_t budget_bytes = 0;
+
+    [[nodiscard]] double hit_rate() const {
+        const auto total = hits + misses;
+        return total > 0 ? double(hits) / double(total) : 0;
+    }
+};
+
+// Общий для всех потоков LRU-кэш страниц текстур с ограничением по памяти.
+// Разбит на независимые сегменты со своими мьютексами, чтобы потоки,
+// читающие разные страницы, не ждали друг друга. Бюджет общий для всех
+// сегментов, поэтому соблюдается и тогда, когда он меньше страницы на
+// сегмент. Страницы отдаются через shared_ptr, поэтому вытеснение не
+// мешает потокам, которые еще читают вытесненную страницу
+class texture_cache {
+ public:
+    using loader = std::function<std::shared_ptr<const texture_page>()>;
+
+    explicit texture_cache(size_t budget_bytes) : budget_bytes_(budget_bytes) {
+    }
+
+    texture_cache(const texture_cache &) = delete;
+    texture_cache &operator=(const texture_cache &) = delete;
+
+    // новый идентификатор для страниц очередной текстуры
+    uint32_t register_texture() {
+        return next_texture_id_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // возвращает страницу key. При промахе страница загружается через load
+    // вне блокировки, так что чтение с диска не останавливает остальные
+    // потоки. Если два потока одновременно загрузили одну страницу, в кэше
+    // остается первая
+    std::shared_ptr<const texture_page> get(const texture_page_key &key,
+                                            const loader &load) {
+        auto &s = shard_for(key);
+        {
+            std::lock_guard lock(s.mutex);
+            const auto it = s.index.find(key);
+            if (it != s.index.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                it->second->last_use = next_use();
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return it->second->page;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+
+        auto page = load();
+        const auto bytes = page->texels.size();
+
+        {
+            std::lock_guard lock(s.mutex);
+            const auto it = s.index.find(key);
+            if (it != s.index.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                it->second->last_use = next_use();
+                return it->second->page;
+            }
+            s.lru.push_front({key, page, bytes, next_use()});
+            s.index.emplace(key, s.lru.begin());
+            resident_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        evict_over_budget(key);
+        return page;
+    }
+
+    [[nodiscard]] texture_cache_stats stats() const {
+        return {hits_.load(std::memory_order_relaxed),
+                misses_.load(std::memory_order_relaxed),
+                evictions_.load(std::memory_order_relaxed),
+                resident_bytes_.load(std::memory_order_relaxed),
+                budget_bytes_};
+    }
+
+    void reset_stats() {
+        hits_ = 0;
+        misses_ = 0;
+        evictions_ = 0;
+    }
+
+ private:
+    static constexpr size_t shard_count = 16;
+
+    struct entry {
+        texture_page_key key;
+        std::shared_ptr<const texture_page> page;
+        size_t bytes;
+        uint64_t last_use;  // значение use_clock_ при последнем обращении
+    };
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> lru;  // в начале - недавно использованные
+        std::unordered_map<texture_page_key,
+                           std::list<entry>::iterator,
+                           texture_page_key_hash>
+            index;
+    };
+
+    size_t budget_bytes_;
+    std::array<shard, shard_count> shards_;
+    std::atomic<uint32_t> next_texture_id_ = 0;
+    std::atomic<uint64_t> hits_ = 0;
+    std::atomic<uint64_t> misses_ = 0;
+    std::atomic<uint64_t> evictions_ = 0;
+    std::atomic<size_t> resident_bytes_ = 0;
+    std::atomic<uint64_t> use_clock_ = 0;
+
+    shard &shard_for(const texture_page_key &key) {
+        return shards_[texture_page_key_hash{}(key) % shard_count];
+    }
+
+    // вызывается под мьютексом сегмента, поэтому внутри сегмента метки
+    // растут от хвоста списка к началу
+    uint64_t next_use() {
+        return use_clock_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // вытесняет страницы, пока весь кэш не уложится в бюджет. Каждый раз
+    // вытесняется страница с самой старой меткой обращения среди хвостов
+    // всех сегментов, то есть порядок - общий LRU. Одновременно
+    // блокируется только один сегмент, поэтому между выбором жертвы и ее
+    // вытеснением хвост может смениться - тогда выбор повторяется.
+    // Страница keep не вытесняется.
+    //
+    // В итоге resident_bytes после каждого get не больше budget_bytes,
+    // кроме двух случаев: одна только что загруженная страница больше всего
+    // бюджета (она остается в кэше), и несколько потоков одновременно
+    // загружают страницы - тогда бюджет ненадолго превышается на их размер
+    void evict_over_budget(const texture_page_key &keep) {
+        while (resident_bytes_.load(std::memory_order_relaxed) >
+               budget_bytes_) {
+            shard *oldest = nullptr;
+            uint64_t oldest_use = 0;
+            for (auto &s : shards_) {
+                std::lock_guard lock(s.mutex);
+                if (s.lru.empty() || s.lru.back().key == keep) {
+                    continue;
+                }
+                if (oldest == nullptr || s.lru.back().last_use < oldest_use) {
+                    oldest = &s;
+                    oldest_use = s.lru.back().last_use;
+                }
+            }
+            if (oldest == nullptr) {
+                return;
+            }
+
+            std::lock_guard lock(oldest->mutex);
+            if (oldest->lru.empty() ||
+                oldest->lru.back().last_use != oldest_use) {
+                continue;
+            }
+            const auto &victim = oldest->lru.back();
+            resident_bytes_.fetch_sub(victim.bytes, std::memory_order_relaxed);
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+            oldest->index.erase(victim.key);
+            oldest->lru.pop_back();
+        }
+    }
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define VEC3_H
 
 #include "common.h"
+#include <algorithm>
 #include <cmath>
 #include <ostream>
 
@@ -151,6 +152,16 @@ inline vec3 random_unit_vector() {
     return unit_vector(random_in_unit_sphere());
 }
 
+// отображает точку (u1, u2) единичного квадрата в равномерно распределенный
+// по сфере единичный вектор. Нужна для сэмплеров с низким расхождением,
+// которые выдают точки квадрата, а не случайные векторы
+inline vec3 sample_unit_vector(float u1, float u2) {
+    const auto z = 1 - 2 * u1;
+    const auto r = sqrt(std::max(0.0f, 1 - z * z));
+    const auto phi = 2 * static_cast<float>(pi) * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
 // n должен быть нормирован
 inline vec3 reflect(const vec3 &v, const vec3 &n) {
     return v - 2 * dot(v, n) * n;
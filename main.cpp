@@ -5,14 +5,41 @@
 #include "hittable_list.h"
 #include "material.h"
 #include "portal.h"
-#include "sphere.h"
+#include "render_job.h"
+#include "scene_cache.h"
 #include "vec3.h"
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    // --scene-cache включает кэш построенных BVH в каталоге кэша
+    // пользователя. Без него на диске ничего не сохраняется
+    bool use_scene_cache = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--scene-cache") {
+            use_scene_cache = true;
+        } else {
+            std::cerr << "ERROR: Unknown argument '" << argv[i] << "'.\n";
+            return 1;
+        }
+    }
 
-int main() {
-    hittable_list world;
+    auto world = make_shared<hittable_list>();
+
+    // Сферы собираются в BVH, который с --scene-cache кэшируется на диске
+    // между запусками
+    paged_bvh_builder spheres;
+    std::vector<shared_ptr<material>> materials;
+    const auto add_sphere = [&](const point3 &center,
+                                float radius,
+                                shared_ptr<material> mat) {
+        spheres.add(center, radius, static_cast<uint32_t>(materials.size()));
+        materials.push_back(std::move(mat));
+    };
 
     auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+    add_sphere(point3(0, -1000, 0), 1000, ground_material);
 
     auto first_portal =
         make_shared<square_portal>(point3(-4, 3, 5), vec3(-1, 0, 0), 4, vec3(0, 1, 0), 1);
@@ -27,8 +54,8 @@ int main() {
     first_portal->set_fluid(make_shared<portal_fluid>(second_portal));
     second_portal->set_fluid(make_shared<portal_fluid>(first_portal));
 
-    world.add(first_portal);
-    world.add(second_portal);
+    world->add(first_portal);
+    world->add(second_portal);
 
     // Случайным образом разбрасываются сферы
     for (int a = -11; a < 11; a++) {
@@ -44,40 +71,44 @@ int main() {
                     // diffuse
                     auto albedo = color::random() * color::random();
                     sphere_material = make_shared<lambertian>(albedo);
-                    world.add(
-                        make_shared<sphere>(center, 0.2, sphere_material));
+                    add_sphere(center, 0.2, sphere_material);
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_float(0, 0.5);
                     sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(
-                        make_shared<sphere>(center, 0.2, sphere_material));
+                    add_sphere(center, 0.2, sphere_material);
                 } else {
                     // glass
                     sphere_material = make_shared<dielectric>(1.5);
-                    world.add(
-                        make_shared<sphere>(center, 0.2, sphere_material));
+                    add_sphere(center, 0.2, sphere_material);
                 }
             }
         }
     }
 
     auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    add_sphere(point3(0, 1, 0), 1.0, material1);
 
     auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    add_sphere(point3(-4, 1, 0), 1.0, material2);
 
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    add_sphere(point3(4, 1, 0), 1.0, material3);
+
+    scene_cache cache(use_scene_cache ? scene_cache::default_directory()
+                                      : std::filesystem::path());
+    world->add(cache.load_or_build(spheres, materials, size_t(64) << 20));
 
     camera cam;
 
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 500;
-    cam.samples_per_pixel = 1;
+    cam.samples_per_pixel = 4;
     cam.max_depth = 13;
+    cam.min_depth = 3;
+    cam.russian_roulette = true;
+    cam.sampling = sampler_kind::sobol;
 
     cam.vfov = 40;
     cam.lookfrom = point3(0, 3, -15);
@@ -86,5 +117,19 @@ int main() {
 
     cam.focus_dist = 1.0;
 
-    cam.render(world);
+    render_options options;
+    options.denoise = true;
+    options.on_progress = [](const render_progress &progress) {
+        std::clog << "\rTiles remaining: "
+                  << (progress.tiles_total - progress.tiles_done) << ' '
+                  << std::flush;
+    };
+
+    const auto job = render_job::start(cam, world, options);
+    job->wait();
+    std::clog << "\rDone.                 \n";
+    std::clog << "Average path length: " << job->average_path_length()
+              << '\n';
+
+    job->write_ppm(std::cout);
 }